@@ -0,0 +1,205 @@
+// Buddy allocator for physically contiguous runs of pages.
+//
+// Physical memory from end to PHYSTOP is managed in blocks of
+// 2^order pages, 0 <= order <= MAXORDER. A block of order k
+// always starts at a physical address that is a multiple of
+// 2^k pages, so its buddy (the other half of the order k+1
+// block containing it) is found by flipping bit k of its page
+// number. kfree_pages() merges a freed block with its buddy
+// for as long as the buddy is free and of the same order.
+//
+// kalloc()/kfree() in kalloc.c keep per-CPU caches of single
+// pages and refill and drain them from here.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+
+extern char end[]; // first address after kernel.
+
+// pgstate[] byte for the first page of each free block.
+#define PG_FREE 0x80
+
+// a free block, linked into its order's list.
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+struct {
+  struct spinlock lock;
+  struct block free[MAXORDER+1];  // list heads, one per order
+  int nfree[MAXORDER+1];          // free blocks of each order
+
+  // fragmentation counters.
+  uint64 nsplit;   // blocks split to satisfy a smaller request
+  uint64 nmerge;   // buddies merged on free
+  uint64 nfail;    // requests that found no large enough block
+} buddy;
+
+// PG_FREE|order for the first page of a free block,
+// zero for every other page.
+static uchar pgstate[NPAGE];
+
+static inline int
+pgindex(void *pa)
+{
+  return ((uint64)pa - KERNBASE) / PGSIZE;
+}
+
+static inline struct block *
+pgaddr(int i)
+{
+  return (struct block *)(KERNBASE + (uint64)i * PGSIZE);
+}
+
+static void
+push(struct block *b, int order)
+{
+  struct block *h = &buddy.free[order];
+
+  b->next = h->next;
+  b->prev = h;
+  h->next->prev = b;
+  h->next = b;
+  buddy.nfree[order]++;
+  pgstate[pgindex(b)] = PG_FREE | order;
+}
+
+static void
+pull(struct block *b, int order)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  buddy.nfree[order]--;
+  pgstate[pgindex(b)] = 0;
+}
+
+void
+buddyinit(void)
+{
+  initlock(&buddy.lock, "buddy");
+  for(int k = 0; k <= MAXORDER; k++){
+    buddy.free[k].next = &buddy.free[k];
+    buddy.free[k].prev = &buddy.free[k];
+  }
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size. Returns 0 if no large enough block is free.
+void *
+kalloc_pages(int order)
+{
+  struct block *b;
+  int k;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_pages: order");
+
+  acquire(&buddy.lock);
+  for(k = order; k <= MAXORDER; k++)
+    if(buddy.nfree[k] > 0)
+      break;
+  if(k > MAXORDER){
+    buddy.nfail++;
+    release(&buddy.lock);
+    return 0;
+  }
+
+  b = buddy.free[k].next;
+  pull(b, k);
+
+  // give back the unused upper halves.
+  while(k > order){
+    k--;
+    push((struct block *)((char *)b + ((uint64)PGSIZE << k)), k);
+    buddy.nsplit++;
+  }
+  release(&buddy.lock);
+
+  return (void *)b;
+}
+
+// Free 2^order pages starting at pa, which must be aligned
+// to their size. The pages need not have come from a single
+// kalloc_pages() call, which lets the pages of a big block
+// be freed one at a time.
+void
+kfree_pages(void *pa, int order)
+{
+  int i, b;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kfree_pages: order");
+  if(((uint64)pa % ((uint64)PGSIZE << order)) != 0 ||
+     (char*)pa < end || (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+
+  i = pgindex(pa);
+
+  acquire(&buddy.lock);
+  if(pgstate[i] & PG_FREE)
+    panic("kfree_pages: double free");
+  while(order < MAXORDER){
+    b = i ^ (1 << order);
+    if(pgstate[b] != (PG_FREE | order))
+      break;
+    pull(pgaddr(b), order);
+    buddy.nmerge++;
+    i &= ~(1 << order);
+    order++;
+  }
+  push(pgaddr(i), order);
+  release(&buddy.lock);
+}
+
+// Number of free pages held by the buddy allocator.
+int
+buddyfree(void)
+{
+  int n = 0;
+
+  acquire(&buddy.lock);
+  for(int k = 0; k <= MAXORDER; k++)
+    n += buddy.nfree[k] << k;
+  release(&buddy.lock);
+  return n;
+}
+
+// Print the free block counts and fragmentation counters
+// to the console.  For debugging.
+void
+buddydump(void)
+{
+  int nfree[MAXORDER+1];
+  uint64 nsplit, nmerge, nfail;
+  int k, pages, big;
+
+  acquire(&buddy.lock);
+  for(k = 0; k <= MAXORDER; k++)
+    nfree[k] = buddy.nfree[k];
+  nsplit = buddy.nsplit;
+  nmerge = buddy.nmerge;
+  nfail = buddy.nfail;
+  release(&buddy.lock);
+
+  printf("buddy: free blocks by order:");
+  pages = big = 0;
+  for(k = 0; k <= MAXORDER; k++){
+    printf(" %d", nfree[k]);
+    pages += nfree[k] << k;
+    if(k >= MEGAORDER)
+      big += nfree[k] << k;
+  }
+  printf("\n");
+  // the fraction of free memory that can't back a megapage.
+  printf("buddy: %d free pages, %d%% fragmented\n",
+         pages, pages ? 100 - (big * 100) / pages : 0);
+  printf("buddy: %d splits, %d merges, %d failed allocations\n",
+         (int)nsplit, (int)nmerge, (int)nfail);
+}
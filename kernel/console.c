@@ -84,6 +84,10 @@ consoleread(int user_dst, uint64 dst, int n)
   char cbuf;
 
   target = n;
+  // either_copyout() below holds cons.lock, so it can't
+  // read in a program page itself.
+  if(user_dst)
+    vmprefault(myproc()->pagetable, dst, n);
   acquire(&cons.lock);
   while(n > 0){
     // wait until interrupt handler has put some
@@ -138,8 +142,9 @@ consoleintr(int c)
   acquire(&cons.lock);
 
   switch(c){
-  case C('P'):  // Print process list.
+  case C('P'):  // Print process list and memory stats.
     procdump();
+    kmemdump();
     break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
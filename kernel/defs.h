@@ -2,12 +2,16 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
+struct spawnact;
 struct stat;
 struct superblock;
+struct timer;
+struct vma;
 
 // bio.c
 void            binit(void);
@@ -17,6 +21,13 @@ void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
+// buddy.c
+void            buddyinit(void);
+void*           kalloc_pages(int);
+void            kfree_pages(void*, int);
+int             buddyfree(void);
+void            buddydump(void);
+
 // console.c
 void            consoleinit(void);
 void            consoleintr(int);
@@ -24,6 +35,7 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execproc(struct proc*, char*, char**);
 
 // file.c
 struct file*    filealloc(void);
@@ -63,6 +75,15 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kzeroinit(void);
+void*           kalloc_zeroed(void);
+void            kref(void*);
+int             krefcnt(void*);
+int             kfreecount(void);
+void*           kalloc_mega(void);
+void            kref_mega(void*);
+void            kfree_mega(void*);
+void            kmemdump(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -71,6 +92,7 @@ void            begin_op(void);
 void            end_op(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -85,12 +107,23 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
+int             vfork(void);
+void            vforkdone(struct proc*, uint64);
+int             spawn(char*, char**, struct spawnact*, int);
+int             clone(uint64, uint64, uint64);
+int             join(void);
+uint64          growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
+void            proc_putpagetable(struct proc*, pagetable_t, uint64);
+void            tglock(struct proc*);
+void            tgunlock(struct proc*);
+struct inode*   cwdget(void);
+void            setcwd(struct inode*);
 int             kill(int);
 int             killed(struct proc*);
+void            kthread(char*, void (*)(void));
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
@@ -102,10 +135,16 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+void            wakeup_one(void*);
+void            wakeproc(struct proc*, void*);
 void            yield(void);
+void            preempt(void);
+int             getlevel(int);
+int             setweight(int, int);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+void            vmaclose(struct vma*);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -113,17 +152,29 @@ void            swtch(struct context*, struct context*);
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
+int             holdingany(void);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+int             slabreap(void);
+void            slabdump(void);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// start.c
+extern uint64   tickbase;
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -133,6 +184,9 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// sysfile.c
+int             spawnfiles(struct file**, struct spawnact*, int);
+
 // syscall.c
 void            argint(int, int*);
 int             argstr(int, char*, int);
@@ -141,8 +195,25 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// textcache.c
+void            textinit(void);
+char*           textget(struct inode*, uint, int);
+char*           textput(struct inode*, uint, int, char*);
+void            textevict(struct inode*);
+int             textreap(void);
+int             textfree(void);
+void            textdump(void);
+
+// timer.c
+void            timerstart(struct timer*, uint);
+void            timerstop(struct timer*);
+void            timerexpire(void);
+int             timernext(uint*);
+int             ticksleep(int);
+
 // trap.c
 extern uint     ticks;
+void            clockintr(void);
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
@@ -155,9 +226,18 @@ void            uartputc(int);
 void            uartputc_sync(int);
 int             uartgetc(void);
 
+// usercopy.S
+int             copy_user(void *, void *, uint64);
+int             copy_user_str(char *, char *, uint64);
+
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+void            asidinit(void);
+void            uvmswitch(struct proc*);
+void            kvmswitch(void);
+int             uvmkmap(pagetable_t);
+void            uvmkunmap(pagetable_t);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
@@ -167,12 +247,16 @@ uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
-void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walklevel(pagetable_t, uint64, int, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
+int             vmfault(pagetable_t, uint64, int);
+void            vmprefault(pagetable_t, uint64, uint64);
+void            tlbpoll(void);
+int             uvmsplit(pagetable_t, uint64);
 
 // plic.c
 void            plicinit(void);
@@ -7,8 +7,6 @@
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
-
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -21,15 +19,31 @@ int flags2perm(int flags)
 
 int
 exec(char *path, char **argv)
+{
+  return execproc(myproc(), path, argv);
+}
+
+// Replace p's user memory with the program path. p is either
+// the current process, or a new one that spawn() is setting up.
+// Returns argc, or -1 leaving p unchanged.
+int
+execproc(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
   int i, off;
-  uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
+  uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase, stacklo;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma vma[NVMA], oldvma[NVMA];
+  int nvma = 0;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
+
+  memset(vma, 0, sizeof(vma));
+
+  // other threads are still running on the page table.
+  if(p->tg && p->tg->ref > 1)
+    return -1;
 
   begin_op();
 
@@ -49,7 +63,7 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program segments.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -59,31 +73,47 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if(ph.vaddr % PGSIZE != 0)
+    if(ph.vaddr + ph.memsz > MAXUVA)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr % PGSIZE != 0 || ph.vaddr < sz)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.memsz == 0)
+      continue;
+    // Nothing is read now: record the segment for
+    // vmfault() to read in a page at a time on first
+    // touch. The zero-filled rest (the bss) is left for
+    // vmfault() too.
+    if(nvma >= NVMA)
       goto bad;
+    vma[nvma].start = ph.vaddr;
+    vma[nvma].fileend = ph.vaddr + ph.filesz;
+    vma[nvma].end = ph.vaddr + ph.memsz;
+    vma[nvma].off = ph.off;
+    vma[nvma].perm = flags2perm(ph.flags) | PTE_R | PTE_U;
+    nvma++;
+    sz = ph.vaddr + ph.memsz;
   }
+
+  // the segments hold references to the executable.
+  for(i = 0; i < nvma; i++)
+    vma[i].ip = idup(ip);
   iunlockput(ip);
   end_op();
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
-  // Allocate two pages at the next page boundary.
-  // Make the first inaccessible as a stack guard.
-  // Use the second as the user stack.
-  sz = PGROUNDUP(sz);
-  uint64 sz1;
-  if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE, PTE_W)) == 0)
+  // Reserve p->stacklimit bytes above the program for the
+  // user stack, past a guard gap that vmfault() won't map.
+  // The heap starts at the top of the stack, which grows
+  // away from it, so the gap is between stack and data.
+  // Allocate just the top page, for the arguments; vmfault()
+  // maps the rest as the stack grows down into it.
+  sz = PGROUNDUP(sz) + USTACKGUARD;
+  stacklo = sz;
+  sz += p->stacklimit;
+  if(uvmalloc(pagetable, sz - PGSIZE, sz, PTE_W) == 0)
     goto bad;
-  sz = sz1;
-  uvmclear(pagetable, sz-2*PGSIZE);
   sp = sz;
   stackbase = sp - PGSIZE;
 
@@ -123,10 +153,26 @@ exec(char *path, char **argv)
   // Commit to the user image.
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
+  p->asid_gen = 0;  // the old ASID may still tag old entries.
   p->sz = sz;
+  p->stackbase = stacklo;
+  p->stacktop = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
-  proc_freepagetable(oldpagetable, oldsz);
+  memmove(oldvma, p->vma, sizeof(oldvma));
+  memmove(p->vma, vma, sizeof(vma));
+
+  // the kernel may be running on the old page table.
+  if(p == myproc()){
+    push_off();
+    uvmswitch(p);
+    pop_off();
+  }
+  if(p->vfparent)
+    vforkdone(p, oldsz);  // the old page table was borrowed.
+  else
+    proc_putpagetable(p, oldpagetable, oldsz);
+  vmaclose(oldvma);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -137,30 +183,6 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  vmaclose(vma);
   return -1;
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
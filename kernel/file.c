@@ -14,15 +14,21 @@
 #include "proc.h"
 
 struct devsw devsw[NDEV];
+
+// file structures come from filecache; ftable.lock protects
+// their ref counts, and nfile keeps at most NFILE open.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  int nfile;
 } ftable;
 
+static struct kmem_cache *filecache;
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  filecache = kmem_cache_create("file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -32,15 +38,22 @@ filealloc(void)
   struct file *f;
 
   acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if(ftable.nfile >= NFILE){
+    release(&ftable.lock);
+    return 0;
   }
+  ftable.nfile++;
   release(&ftable.lock);
-  return 0;
+
+  if((f = kmem_cache_alloc(filecache)) == 0){
+    acquire(&ftable.lock);
+    ftable.nfile--;
+    release(&ftable.lock);
+    return 0;
+  }
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,9 +82,9 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
+  ftable.nfile--;
   release(&ftable.lock);
+  kmem_cache_free(filecache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -118,6 +131,9 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
+    // readi() copies out with f->ip locked, so it can't
+    // read in a program page itself.
+    vmprefault(myproc()->pagetable, addr, n);
     ilock(f->ip);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
@@ -154,6 +170,9 @@ filewrite(struct file *f, uint64 addr, int n)
     // might be writing a device like the console.
     int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
     int i = 0;
+
+    // as in fileread().
+    vmprefault(myproc()->pagetable, addr, n);
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
@@ -1,6 +1,30 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// The pages come from the buddy allocator in buddy.c.
+// Each CPU caches single pages on its own free list,
+// protected by its own lock, so that kalloc() and kfree()
+// on different CPUs don't contend. A CPU refills its list
+// from the buddy allocator NBATCH pages at a time, and
+// hands NBATCH pages back when it holds more than NHIGH.
+// If the buddy allocator is out of memory, a CPU whose
+// list runs dry steals a batch from another CPU's list.
+// If that fails too, kalloc() takes a page from the zero pool
+// or asks the slab allocator and the text cache to give back
+// the pages they are caching before giving up.
+//
+// The kzero kernel thread keeps a pool of up to ZHIGH
+// pre-zeroed pages for kalloc_zeroed(), refilling it whenever
+// it drops below ZLOW. Pages are only filled with junk on
+// kalloc() and kfree() when built with KALLOC_DEBUG.
+//
+// Each allocated page has a reference count, so that fork()
+// can share pages copy-on-write. kalloc() sets it to 1, kref()
+// adds a reference, and kfree() only frees the page when the
+// last reference is dropped. kalloc_mega() allocates 2MB
+// megapages for user heaps; each page of a megapage keeps
+// its own reference count.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +33,14 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define NBATCHORDER 5
+#define NBATCH (1 << NBATCHORDER) // pages per refill or drain
+#define NHIGH (4*NBATCH)          // drain a CPU's list above this
+#define NSTEAL 64                 // max pages moved per steal
+
+#define ZHIGH 128   // kzero fills the zero pool up to this
+#define ZLOW  32    // and is woken when it drops below this
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -21,12 +53,31 @@ struct run {
 struct {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+} kmem[NCPU];
+
+struct {
+  struct spinlock lock;
+  struct run *list;     // zeroed pages, except for r->next
+  int n;
+  int zeroing;          // kzero has a page out to zero, soon on list
+  struct proc *thread;  // kzero
+  int sleeping;         // kzero is waiting for the pool to drain
+  uint64 hits;          // kalloc_zeroed() found a zeroed page
+  uint64 misses;        // kalloc_zeroed() had to zero one itself
+} zpool;
+
+// reference counts of allocated pages, indexed by page number.
+static int pgref[(PHYSTOP - KERNBASE) / PGSIZE];
+#define PGREF(pa) pgref[((uint64)(pa) - KERNBASE) / PGSIZE]
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  buddyinit();
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&zpool.lock, "zpool");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -36,47 +87,417 @@ freerange(void *pa_start, void *pa_end)
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
   for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+    kfree_pages(p, 0);
+}
+
+// Push the n pages starting at pa onto CPU id's list.
+static void
+pushpages(int id, char *pa, int n)
+{
+  struct run *r;
+
+  acquire(&kmem[id].lock);
+  for(int i = 0; i < n; i++){
+    r = (struct run*)(pa + i*PGSIZE);
+    r->next = kmem[id].freelist;
+    kmem[id].freelist = r;
+  }
+  kmem[id].nfree += n;
+  release(&kmem[id].lock);
+}
+
+// Move up to half of another CPU's free pages (at most
+// NSTEAL) onto CPU id's list. Only one kmem lock is held
+// at a time, so two CPUs stealing from each other can't
+// deadlock. Returns the number of pages moved.
+// Caller must have interrupts off.
+static int
+steal(int id)
+{
+  struct run *first, *last;
+  int i, j, n;
+
+  for(j = 1; j < NCPU; j++){
+    i = (id + j) % NCPU;
+    if(kmem[i].nfree == 0)  // racy peek; rechecked under the lock.
+      continue;
+
+    acquire(&kmem[i].lock);
+    n = (kmem[i].nfree + 1) / 2;
+    if(n > NSTEAL)
+      n = NSTEAL;
+    first = last = kmem[i].freelist;
+    if(n == 0 || first == 0){
+      release(&kmem[i].lock);
+      continue;
+    }
+    for(int k = 1; k < n; k++)
+      last = last->next;
+    kmem[i].freelist = last->next;
+    kmem[i].nfree -= n;
+    release(&kmem[i].lock);
+
+    acquire(&kmem[id].lock);
+    last->next = kmem[id].freelist;
+    kmem[id].freelist = first;
+    kmem[id].nfree += n;
+    release(&kmem[id].lock);
+    return n;
+  }
+  return 0;
+}
+
+// Refill CPU id's empty list, preferably with a whole
+// NBATCH-page block from the buddy allocator.
+// Returns the number of pages added.
+// Caller must have interrupts off.
+static int
+refill(int id)
+{
+  char *pa;
+
+  if((pa = kalloc_pages(NBATCHORDER)) != 0){
+    pushpages(id, pa, NBATCH);
+    return NBATCH;
+  }
+  if((pa = kalloc_pages(0)) != 0){
+    pushpages(id, pa, 1);
+    return 1;
+  }
+  return steal(id);
+}
+
+// Give NBATCH pages from CPU id's list back to the
+// buddy allocator, so that they can be coalesced.
+// Caller must have interrupts off.
+static void
+drain(int id)
+{
+  struct run *r, *next;
+  int n;
+
+  acquire(&kmem[id].lock);
+  r = kmem[id].freelist;
+  for(n = 0; n < NBATCH && kmem[id].freelist; n++)
+    kmem[id].freelist = kmem[id].freelist->next;
+  kmem[id].nfree -= n;
+  release(&kmem[id].lock);
+
+  for(; n > 0; n--){
+    next = r->next;
+    kfree_pages(r, 0);
+    r = next;
+  }
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
 void
 kfree(void *pa)
 {
   struct run *r;
+  int id, n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
+  if(PGREF(pa) < 1)
+    panic("kfree: ref");
+  if(__sync_sub_and_fetch(&PGREF(pa), 1) > 0)
+    return;
 
+#ifdef KALLOC_DEBUG
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  acquire(&kmem[id].lock);
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = r;
+  n = ++kmem[id].nfree;
+  release(&kmem[id].lock);
+  if(n > NHIGH)
+    drain(id);
+  pop_off();
+}
+
+// Take a page from this CPU's free list, refilling it
+// if it is empty. Returns 0 if there are no free pages.
+static struct run *
+allocpage(void)
+{
+  struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+  for(;;){
+    acquire(&kmem[id].lock);
+    r = kmem[id].freelist;
+    if(r){
+      kmem[id].freelist = r->next;
+      kmem[id].nfree--;
+    }
+    release(&kmem[id].lock);
+    if(r || refill(id) == 0)
+      break;
+  }
+  pop_off();
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// The contents of the page are undefined.
 void *
 kalloc(void)
 {
   struct run *r;
+  int zeroing;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  for(;;){
+    if((r = allocpage()) != 0)
+      break;
+    // Out of free pages. The pool may have some.
+    acquire(&zpool.lock);
+    if((r = zpool.list) != 0){
+      zpool.list = r->next;
+      zpool.n--;
+    }
+    zeroing = zpool.zeroing;
+    release(&zpool.lock);
+    if(r)
+      break;
+    // kzero zeroes with interrupts off, so the page it
+    // has out will be on the list in a moment.
+    if(zeroing)
+      continue;
+    if(slabreap() == 0 && textreap() == 0)
+      break;
+  }
 
-  if(r)
+  if(r){
+    PGREF(r) = 1;
+#ifdef KALLOC_DEBUG
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  }
+  return (void*)r;
+}
+
+// Allocate one zeroed page, preferably from the zero pool.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  acquire(&zpool.lock);
+  if((r = zpool.list) != 0){
+    zpool.list = r->next;
+    zpool.n--;
+    zpool.hits++;
+  } else {
+    zpool.misses++;
+  }
+  if(zpool.n < ZLOW && zpool.sleeping){
+    zpool.sleeping = 0;
+    wakeproc(zpool.thread, &zpool);
+  }
+  release(&zpool.lock);
+
+  if(r){
+    r->next = 0;
+    PGREF(r) = 1;
+  } else if((r = kalloc()) != 0){
+    memset((char*)r, 0, PGSIZE);
+  }
   return (void*)r;
 }
+
+// Add a reference to an allocated page.
+void
+kref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kref");
+  if(__sync_fetch_and_add(&PGREF(pa), 1) < 1)
+    panic("kref: free page");
+}
+
+// Number of references to an allocated page.
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&PGREF(pa), __ATOMIC_SEQ_CST);
+}
+
+// Body of the kzero kernel thread.
+static void
+kzero(void)
+{
+  struct run *r;
+
+  acquire(&zpool.lock);
+  zpool.thread = myproc();
+  for(;;){
+    if(zpool.n >= ZHIGH || (r = allocpage()) == 0){
+      // full, or out of memory: wait until
+      // kalloc_zeroed() drains the pool below ZLOW.
+      zpool.sleeping = 1;
+      sleep(&zpool, &zpool.lock);
+      continue;
+    }
+
+    // zero the page without the lock, so that
+    // kalloc_zeroed() needn't wait for it, but with
+    // interrupts off, so that an out of memory kalloc()
+    // need only spin until it is done.
+    zpool.zeroing = 1;
+    push_off();
+    release(&zpool.lock);
+    memset((char*)r, 0, PGSIZE);
+    acquire(&zpool.lock);
+    pop_off();
+
+    r->next = zpool.list;
+    zpool.list = r;
+    zpool.n++;
+    zpool.zeroing = 0;
+  }
+}
+
+// Start the kzero thread.
+void
+kzeroinit(void)
+{
+  kthread("kzero", kzero);
+}
+
+// Give every page on every CPU's free list back to the
+// buddy allocator, so that free pages can coalesce.
+static void
+drainall(void)
+{
+  struct run *r, *next;
+
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    r = kmem[i].freelist;
+    kmem[i].freelist = 0;
+    kmem[i].nfree = 0;
+    release(&kmem[i].lock);
+    for(; r; r = next){
+      next = r->next;
+      kfree_pages(r, 0);
+    }
+  }
+}
+
+// Allocate a zeroed 2MB megapage, aligned to its size.
+// Each of its pages gets a reference count of 1, as if
+// it had come from kalloc(), so that a megapage mapping
+// can later be split into page mappings.
+// Returns 0 if there is no free 2MB block.
+void *
+kalloc_mega(void)
+{
+  char *pa;
+
+  if((pa = kalloc_pages(MEGAORDER)) == 0){
+    // free pages cached per-CPU may complete a block.
+    drainall();
+    if((pa = kalloc_pages(MEGAORDER)) == 0)
+      return 0;
+  }
+  memset(pa, 0, MEGAPGSIZE);
+  for(int i = 0; i < (1 << MEGAORDER); i++)
+    PGREF(pa + i*PGSIZE) = 1;
+  return pa;
+}
+
+// Add a reference to each page of a megapage.
+void
+kref_mega(void *pa)
+{
+  for(int i = 0; i < (1 << MEGAORDER); i++)
+    kref((char*)pa + i*PGSIZE);
+}
+
+// Drop a reference to each page of a megapage. If that
+// was the last reference to every page, the 2MB block goes
+// straight back to the buddy allocator; otherwise the pages
+// whose last reference was dropped are freed one by one.
+void
+kfree_mega(void *pa)
+{
+  uint64 last[(1 << MEGAORDER) / 64];
+  char *p;
+  int i, n;
+
+  if(((uint64)pa % MEGAPGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kfree_mega");
+
+  memset(last, 0, sizeof(last));
+  n = 0;
+  for(i = 0; i < (1 << MEGAORDER); i++){
+    p = (char*)pa + i*PGSIZE;
+    if(PGREF(p) < 1)
+      panic("kfree_mega: ref");
+    if(__sync_sub_and_fetch(&PGREF(p), 1) == 0){
+      last[i / 64] |= 1L << (i % 64);
+      n++;
+    }
+  }
+
+  if(n == (1 << MEGAORDER)){
+#ifdef KALLOC_DEBUG
+    memset(pa, 1, MEGAPGSIZE);
+#endif
+    kfree_pages(pa, MEGAORDER);
+    return;
+  }
+  for(i = 0; i < (1 << MEGAORDER); i++){
+    if(last[i / 64] & (1L << (i % 64))){
+      // kfree() drops the reference itself.
+      p = (char*)pa + i*PGSIZE;
+      PGREF(p) = 1;
+      kfree(p);
+    }
+  }
+}
+
+// Number of free pages, including those cached per-CPU,
+// in the zero pool, and in the text cache but mapped by no
+// process. Only a hint: no locks are held.
+int
+kfreecount(void)
+{
+  int n = buddyfree() + zpool.n + zpool.zeroing + textfree();
+
+  for(int i = 0; i < NCPU; i++)
+    n += kmem[i].nfree;
+  return n;
+}
+
+// Print the per-CPU free list lengths and the buddy
+// allocator's state to the console.  For debugging.
+// No lock on the per-CPU lists, like procdump().
+void
+kmemdump(void)
+{
+  printf("kmem: per-CPU free pages:");
+  for(int i = 0; i < NCPU; i++)
+    printf(" %d", kmem[i].nfree);
+  printf("\n");
+  printf("kmem: %d zeroed pages, %d hits, %d misses\n",
+         zpool.n, (int)zpool.hits, (int)zpool.misses);
+  buddydump();
+  slabdump();
+  textdump();
+}
@@ -135,6 +135,10 @@ begin_op(void)
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      // end_op() wakes just one waiter; pass it on
+      // if there's room for another op.
+      if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS <= LOGSIZE)
+        wakeup_one(&log);
       release(&log.lock);
       break;
     }
@@ -159,7 +163,7 @@ end_op(void)
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
     // the amount of reserved space.
-    wakeup(&log);
+    wakeup_one(&log);
   }
   release(&log.lock);
 
@@ -169,7 +173,7 @@ end_op(void)
     commit();
     acquire(&log.lock);
     log.committing = 0;
-    wakeup(&log);
+    wakeup_one(&log);
     release(&log.lock);
   }
 }
@@ -27,6 +27,7 @@
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid)) // software interrupt.
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -48,9 +49,11 @@
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
 
-// map kernel stacks beneath the trampoline,
-// each surrounded by invalid guard pages.
-#define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
+// map kernel stacks at the top of the 1GB below the
+// trampoline's, each surrounded by invalid guard pages.
+// every process page table shares that 1GB with the kernel's.
+#define KSTACKTOP (MAXVA - (1L << 30))
+#define KSTACK(p) (KSTACKTOP - ((p)+1)* 2*PGSIZE)
 
 // User memory layout.
 // Address zero first:
@@ -59,6 +62,27 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   MAXUVA (the kernel's device mappings start here)
+//   ...
+//   THREADFRAME(i) (trapframe of a clone() thread in proc[i])
+//   USYSCALL (p->usyscall, read-only for the user)
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define USYSCALL (TRAPFRAME - PGSIZE)
+#define THREADFRAME(i) (USYSCALL - ((i)+1)*PGSIZE)
+
+// user memory ends below the first device the kernel maps,
+// so that the kernel can share a process's page table.
+#define MAXUVA PLIC
+
+#ifndef __ASSEMBLER__
+// the kernel publishes these in each process's usyscall
+// page, for user code to read without a system call.
+// see ugetpid() and uuptime() in user/ulib.c.
+struct usyscall {
+  int pid;           // Process ID
+  uint64 tickbase;   // time CSR value at tick 0
+  uint64 tickcycles; // time CSR cycles per tick
+};
+#endif
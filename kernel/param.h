@@ -6,8 +6,17 @@
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define NVMA          4  // max program segments per process
+#define USTACKLIMIT  (1024*1024)  // default max size of a user stack
+#define USTACKGUARD  (16*4096)    // unmapped gap below a user stack; a frame over 64KB jumps it into data
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define MAXORDER     10    // largest buddy block is 2^MAXORDER pages
+#define TICKCYCLES   1000000 // time CSR cycles per tick; about 1/10th second in qemu
+#define QUANTUM      TICKCYCLES // time CSR cycles a process runs before preemption
+#define NLEVEL       3     // scheduling priority levels
+#define BOOSTTICKS   10    // ticks between boosts of every process to level 0
+#define MAXWEIGHT    100   // largest setweight() weight
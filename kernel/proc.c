@@ -16,10 +16,88 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
 static void freeproc(struct proc *p);
+static void setrunnable(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
+static struct kmem_cache *tgcache;  // struct tgroup
+
+// Per-CPU queues of RUNNABLE processes. A process goes
+// on the queue of the CPU it last ran on, and a CPU's
+// scheduler() runs the process at the head of its own
+// queue, or, if that is empty, steals one from the
+// longest other queue. A CPU with nothing to run waits
+// in idle() until setrunnable() sends it an interrupt.
+// Lock order: p->lock, then a queue's lock.
+#ifdef SCHED_VRUNTIME
+// Each queue is kept sorted by virtual runtime, the
+// time a process has run divided by its weight (see
+// setweight()). A CPU runs the process with the least
+// vruntime on any queue, not just its own, until its
+// vruntime passes that of the least waiting anywhere
+// (see preempt()). Under contention each process gets
+// a share of all the CPUs in proportion to its weight,
+// whichever queues the processes happen to be on.
+struct runq {
+  struct spinlock lock;
+  struct proc *head;      // lowest vruntime first, read without the lock as a hint
+  int n;                  // length, read without the lock as a hint
+  int idle;               // the CPU is in idle()
+} runqs[NCPU];
+
+// vruntime of the last process any CPU took to run.
+// Only ever goes up.
+static uint64 minvr;
+#else
+// Each queue is a multi-level feedback queue: one FIFO
+// per priority level, with the lowest non-empty level
+// running first. A process starts at level 0 and moves
+// down a level each time it runs for the whole of its
+// level's time slice (see preempt()), so processes that
+// mostly sleep stay above ones that compute. Every
+// BOOSTTICKS ticks all processes go back to level 0, so
+// that those at the bottom still run.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NLEVEL];
+  struct proc *tail[NLEVEL];
+  int n;                  // length, read without the lock as a hint
+  int idle;               // the CPU is in idle()
+  uint boost;             // priority boost of the queued processes
+} runqs[NCPU];
+
+// time slice at level l, in time CSR cycles.
+#define SLICE(l) ((uint64)QUANTUM << (l))
+
+// the current priority boost.
+static inline uint
+curboost(void)
+{
+  return ticks / BOOSTTICKS;
+}
+#endif
+
+// Hash table of wait queues. A process sleeping on a
+// channel is on the queue the channel's address hashes
+// to, so wakeup() looks only at the processes there.
+// Lock order: a queue's lock, then p->lock.
+#define NWAITQ 61
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;      // oldest sleeper first
+} waitqs[NWAITQ];
+
+// A wakeup is futile if the process it wakes next sleeps
+// on the same channel without first waking anyone itself
+// or returning to user space. Both counts are hints.
+struct {
+  uint64 woken;
+  uint64 futile;
+} wakestats;
+
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
 // memory model when using p->parent.
@@ -51,11 +129,16 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runqs[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitqs[i].lock, "waitq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
       p->kstack = KSTACK((int) (p - proc));
   }
+  tgcache = kmem_cache_create("tgroup", sizeof(struct tgroup));
 }
 
 // Must be called with interrupts disabled,
@@ -103,11 +186,10 @@ allocpid()
 }
 
 // Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// If found, initialize the state the scheduler needs,
+// and return with p->lock held; else return 0.
 static struct proc*
-allocproc(void)
+procslot(void)
 {
   struct proc *p;
 
@@ -122,8 +204,33 @@ allocproc(void)
   return 0;
 
 found:
-  p->pid = allocpid();
   p->state = USED;
+  p->cpu = cpuid();
+  p->level = 0;
+  p->used = 0;
+  p->vruntime = 0;
+  p->weight = 1;
+#ifndef SCHED_VRUNTIME
+  p->boost = curboost();
+#endif
+  return p;
+}
+
+// Look in the process table for an UNUSED proc.
+// If found, initialize state required to run in the kernel,
+// and return with p->lock held.
+// If there are no free procs, or a memory allocation fails, return 0.
+static struct proc*
+allocproc(void)
+{
+  struct proc *p;
+
+  if((p = procslot()) == 0)
+    return 0;
+  p->pid = allocpid();
+  p->stacklimit = USTACKLIMIT;
+  p->ofile = p->files;
+  p->tfva = TRAPFRAME;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -132,6 +239,16 @@ found:
     return 0;
   }
 
+  // Allocate and fill in the usyscall page.
+  if((p->usyscall = (struct usyscall *)kalloc_zeroed()) == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+  p->usyscall->pid = p->pid;
+  p->usyscall->tickbase = tickbase;
+  p->usyscall->tickcycles = TICKCYCLES;
+
   // An empty user page table.
   p->pagetable = proc_pagetable(p);
   if(p->pagetable == 0){
@@ -155,19 +272,28 @@ found:
 static void
 freeproc(struct proc *p)
 {
+  if(p->pagetable)
+    proc_putpagetable(p, p->pagetable, p->sz);
+  p->pagetable = 0;
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
-  p->pagetable = 0;
+  if(p->usyscall)
+    kfree((void*)p->usyscall);
+  p->usyscall = 0;
   p->sz = 0;
+  p->stackbase = 0;
+  p->stacktop = 0;
   p->pid = 0;
   p->parent = 0;
+  p->vfparent = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
+  p->asid_gen = 0;
+  p->tlbstale = 0;
   p->state = UNUSED;
 }
 
@@ -183,12 +309,20 @@ proc_pagetable(struct proc *p)
   if(pagetable == 0)
     return 0;
 
+  // share the kernel's mappings, below PTE_U, since
+  // the kernel runs on this page table too.
+  if(uvmkmap(pagetable) < 0){
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+
   // map the trampoline code (for system call return)
   // at the highest user virtual address.
   // only the supervisor uses it, on the way
   // to/from user space, so not PTE_U.
   if(mappages(pagetable, TRAMPOLINE, PGSIZE,
               (uint64)trampoline, PTE_R | PTE_X) < 0){
+    uvmkunmap(pagetable);
     uvmfree(pagetable, 0);
     return 0;
   }
@@ -198,6 +332,18 @@ proc_pagetable(struct proc *p)
   if(mappages(pagetable, TRAPFRAME, PGSIZE,
               (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmkunmap(pagetable);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+
+  // map the usyscall page just below the trapframe page,
+  // read-only for user code.
+  if(mappages(pagetable, USYSCALL, PGSIZE,
+              (uint64)(p->usyscall), PTE_R | PTE_U) < 0){
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmkunmap(pagetable);
     uvmfree(pagetable, 0);
     return 0;
   }
@@ -212,9 +358,63 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  uvmunmap(pagetable, USYSCALL, 1, 0);
+  uvmkunmap(pagetable);
   uvmfree(pagetable, sz);
 }
 
+// Drop p's use of pagetable, which is sz bytes, as
+// freeproc() and exec() do. If threads still share it (see
+// clone()) only p's trapframe is unmapped; otherwise the
+// page table and its memory are freed, and p, if exec()
+// goes on with it, leaves the thread group.
+void
+proc_putpagetable(struct proc *p, pagetable_t pagetable, uint64 sz)
+{
+  struct tgroup *tg = p->tg;
+
+  if(tg == 0){
+    proc_freepagetable(pagetable, sz);
+    return;
+  }
+
+  acquire(&tg->lock);
+  if(--tg->ref > 0){
+    uvmunmap(pagetable, p->tfva, 1, 0);
+    release(&tg->lock);
+  } else {
+    release(&tg->lock);
+    if(p->tfva != TRAPFRAME)
+      uvmunmap(pagetable, p->tfva, 1, 0);
+    proc_freepagetable(pagetable, sz);
+    // no other thread is left to use the files.
+    memmove(p->files, tg->ofile, sizeof(p->files));
+    // the usyscall page was the group's.
+    p->usyscall->pid = p->pid;
+    kmem_cache_free(tgcache, tg);
+  }
+  p->tg = 0;
+  p->tfva = TRAPFRAME;
+  p->ofile = p->files;
+}
+
+// Lock p's thread group, if it has one, against changes
+// to the page table, the open files and the current
+// directory by the other threads.
+void
+tglock(struct proc *p)
+{
+  if(p->tg)
+    acquire(&p->tg->lock);
+}
+
+void
+tgunlock(struct proc *p)
+{
+  if(p->tg)
+    release(&p->tg->lock);
+}
+
 // a user program that calls exec("/init")
 // assembled from ../user/initcode.S
 // od -t xC ../user/initcode
@@ -249,29 +449,129 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
-// Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
-int
+// Start a kernel thread that runs fn() in its own proc.
+// fn() must never return; the thread never enters user
+// space and never exits, so it has no pid, trapframe,
+// or user page table, and runs on the kernel's.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = procslot()) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  memset(&p->context, 0, sizeof(p->context));
+  p->context.ra = (uint64)kthreadret;
+  p->context.sp = p->kstack + PGSIZE;
+  safestrcpy(p->name, name, sizeof(p->name));
+  setrunnable(p);
+  release(&p->lock);
+}
+
+// Grow or shrink user memory by n bytes, for the current
+// process and every thread sharing its memory.
+// Return the old size, or -1 on failure.
+uint64
 growproc(int n)
 {
-  uint64 sz;
-  struct proc *p = myproc();
+  uint64 sz, oldsz;
+  struct proc *p = myproc(), *pp;
 
-  sz = p->sz;
+  tglock(p);
+  oldsz = sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
-      return -1;
-    }
+    // Only reserve the address space; vmfault() maps
+    // each page on first touch. Refuse growth that can't
+    // possibly be backed by the free memory.
+    if(sz + n > MAXUVA || n / PGSIZE > kfreecount())
+      goto bad;
+    sz += n;
   } else if(n < 0){
+    // a megapage that would be cut in two must be split.
+    if(uvmsplit(p->pagetable, PGROUNDUP(sz + n)) < 0)
+      goto bad;
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
   p->sz = sz;
-  return 0;
+  if(p->tg){
+    // zombies too: the last one out frees sz bytes.
+    for(pp = proc; pp < &proc[NPROC]; pp++)
+      if(pp->tg == p->tg)
+        pp->sz = sz;
+  }
+  tgunlock(p);
+  return oldsz;
+
+ bad:
+  tgunlock(p);
+  return -1;
+}
+
+// Drop the references an array of NVMA program
+// segments holds on their executables.
+void
+vmaclose(struct vma *vma)
+{
+  for(int i = 0; i < NVMA; i++){
+    if(vma[i].ip){
+      begin_op();
+      iput(vma[i].ip);
+      end_op();
+    }
+    vma[i].ip = 0;
+  }
+}
+
+// Close p's open files, unless other threads still use
+// them, and drop its references to its current directory
+// and its executable.
+static void
+putfiles(struct proc *p)
+{
+  struct inode *cwd;
+  int last = 1;
+
+  // setcwd() in another thread may replace p->cwd.
+  tglock(p);
+  if(p->tg)
+    last = --p->tg->nlive == 0;
+  cwd = p->cwd;
+  p->cwd = 0;
+  tgunlock(p);
+
+  for(int fd = 0; last && fd < NOFILE; fd++){
+    if(p->ofile[fd]){
+      struct file *f = p->ofile[fd];
+      fileclose(f);
+      p->ofile[fd] = 0;
+    }
+  }
+
+  if(cwd){
+    begin_op();
+    iput(cwd);
+    end_op();
+  }
+  vmaclose(p->vma);
+}
+
+// Give np references to p's open files and current
+// directory.
+static void
+dupfiles(struct proc *np, struct proc *p)
+{
+  tglock(p);
+  for(int i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
+  tgunlock(p);
 }
 
 // Create a new process, copying the parent.
@@ -288,13 +588,17 @@ fork(void)
     return -1;
   }
 
-  // Copy user memory from parent to child.
+  // Copy user memory from parent to child, while
+  // no other thread changes it.
+  tglock(p);
   if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+    tgunlock(p);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  tgunlock(p);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -303,10 +607,283 @@ fork(void)
   np->trapframe->a0 = 0;
 
   // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
+  dupfiles(np, p);
+  for(i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(p->vma[i].ip)
+      np->vma[i].ip = idup(p->vma[i].ip);
+  }
+
+  np->stackbase = p->stackbase;
+  np->stacktop = p->stacktop;
+  np->stacklimit = p->stacklimit;
+  np->weight = p->weight;
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Point the trapframe and usyscall mappings of pagetable,
+// which a vfork() child may be borrowing, at p's pages.
+static void
+vfmap(pagetable_t pagetable, struct proc *p)
+{
+  pte_t *pte;
+
+  pte = walk(pagetable, TRAPFRAME, 0);
+  *pte = PA2PTE(p->trapframe) | PTE_FLAGS(*pte);
+  pte = walk(pagetable, USYSCALL, 0);
+  *pte = PA2PTE(p->usyscall) | PTE_FLAGS(*pte);
+}
+
+// Create a new process that runs in the caller's memory
+// instead of a copy of it, and suspend the caller until
+// the child calls exec() or exit(). The child gets its
+// own trapframe and usyscall pages, mapped in place of
+// the caller's while it borrows the page table.
+// A thread (see clone()) gets a fork() instead, since the
+// other threads go on using the memory.
+// Returns the child's pid, or -1.
+int
+vfork(void)
+{
+  int i, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if(p->tg)
+    return fork();
+
+  // Allocate process.
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+
+  proc_freepagetable(np->pagetable, 0);
+  np->pagetable = p->pagetable;
+  np->sz = p->sz;
+  vfmap(p->pagetable, np);
+
+  // copy saved user registers.
+  *(np->trapframe) = *(p->trapframe);
+
+  // Cause vfork to return 0 in the child.
+  np->trapframe->a0 = 0;
+
+  // increment reference counts on open file descriptors.
+  dupfiles(np, p);
+  for(i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(p->vma[i].ip)
+      np->vma[i].ip = idup(p->vma[i].ip);
+  }
+
+  np->stackbase = p->stackbase;
+  np->stacktop = p->stacktop;
+  np->stacklimit = p->stacklimit;
+  np->weight = p->weight;
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  np->vfparent = p;
+
+  acquire(&np->lock);
+  setrunnable(np);
+  release(&np->lock);
+
+  // vforkdone() clears np->vfparent. np can't be freed
+  // before then, since only p can wait() for it.
+  while(np->vfparent)
+    sleep(p, &wait_lock);
+  release(&wait_lock);
+
+  return pid;
+}
+
+// Give the memory that vfork() child p borrows, now sz
+// bytes, back to its parent, and wake the parent. This CPU
+// must already be off the borrowed page table.
+// Caller must hold wait_lock.
+static void
+vfrelease(struct proc *p, uint64 sz)
+{
+  struct proc *pp = p->vfparent;
+
+  vfmap(pp->pagetable, pp);
+  pp->sz = sz;
+  // p may have changed the mappings, which leaves entries
+  // tagged with pp's ASID stale.
+  pp->asid_gen = 0;
+  p->vfparent = 0;
+  wakeup(pp);
+}
+
+// Called by exec() in a vfork() child, once it has
+// switched to its new page table.
+void
+vforkdone(struct proc *p, uint64 sz)
+{
+  acquire(&wait_lock);
+  vfrelease(p, sz);
+  release(&wait_lock);
+}
+
+// Create a process that runs the program path with
+// arguments argv, as if a fork() of the current process
+// applied the file actions act[0..nact-1] and then called
+// exec(). None of the caller's memory is copied.
+// Returns the new pid, or -1.
+int
+spawn(char *path, char **argv, struct spawnact *act, int nact)
+{
+  int pid;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if((np = allocproc()) == 0)
+    return -1;
+  // np stays USED, which the scheduler ignores, while
+  // exec() sleeps reading the program.
+  release(&np->lock);
+
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  np->stacklimit = p->stacklimit;
+  np->weight = p->weight;
+  dupfiles(np, p);
+
+  if(spawnfiles(np->ofile, act, nact) < 0 ||
+     (np->trapframe->a0 = execproc(np, path, argv)) == -1){
+    putfiles(np);
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
+  pid = np->pid;
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Move p's open files into a new thread group of which p
+// is the only member. Returns 0, or -1 if out of memory.
+static int
+tgcreate(struct proc *p)
+{
+  struct tgroup *tg;
+
+  if((tg = kmem_cache_alloc(tgcache)) == 0)
+    return -1;
+  initlock(&tg->lock, "tgroup");
+  tg->ref = 1;
+  tg->nlive = 1;
+  tg->pid = p->pid;
+  memmove(tg->ofile, p->files, sizeof(tg->ofile));
+  memset(p->files, 0, sizeof(p->files));
+  p->ofile = tg->ofile;
+  p->tg = tg;
+  return 0;
+}
+
+// Create a thread: a process that shares the caller's
+// memory, open files and current directory, and that
+// starts by calling fn(arg) on the user stack whose top
+// is stack. fn must not return, but call exit(), which
+// ends just the thread. The thread has a trapframe of its
+// own, mapped at THREADFRAME() of its slot in proc[], and
+// shares the usyscall page of the thread group. Like
+// ugetpid(), getpid() in any thread returns the pid of the
+// group's first process; the thread's own pid is only for
+// join() and kill(). Only the caller can join() it.
+// Returns the thread's pid, or -1.
+int
+clone(uint64 fn, uint64 stack, uint64 arg)
+{
+  int i, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct tgroup *tg;
+
+  // a vfork() child's memory is borrowed.
+  if(p->vfparent)
+    return -1;
+  if(p->tg == 0 && tgcreate(p) < 0)
+    return -1;
+  tg = p->tg;
+
+  // Allocate process.
+  if((np = allocproc()) == 0)
+    return -1;
+
+  proc_freepagetable(np->pagetable, 0);
+  np->pagetable = 0;
+  kfree((void*)np->usyscall);
+  np->usyscall = p->usyscall;
+  kref((void*)np->usyscall);
+
+  acquire(&tg->lock);
+  np->tfva = THREADFRAME(np - proc);
+  if(mappages(p->pagetable, np->tfva, PGSIZE,
+              (uint64)(np->trapframe), PTE_R | PTE_W) < 0){
+    release(&tg->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->pagetable = p->pagetable;
+  np->sz = p->sz;
+  np->tg = tg;
+  tg->ref++;
+  tg->nlive++;
+  np->ofile = tg->ofile;
   np->cwd = idup(p->cwd);
+  release(&tg->lock);
+
+  // start at fn(arg), on the new stack. returning
+  // from fn faults, at MAXUVA.
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->sp = stack & ~15;
+  np->trapframe->a0 = arg;
+  np->trapframe->ra = MAXUVA;
+
+  for(i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(p->vma[i].ip)
+      np->vma[i].ip = idup(p->vma[i].ip);
+  }
+
+  np->stackbase = p->stackbase;
+  np->stacktop = p->stacktop;
+  np->stacklimit = p->stacklimit;
+  np->weight = p->weight;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -319,12 +896,55 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
 }
 
+// Return a new reference to the current directory,
+// which a chdir() in another thread may be replacing.
+struct inode*
+cwdget(void)
+{
+  struct proc *p = myproc();
+  struct inode *ip;
+
+  tglock(p);
+  ip = idup(p->cwd);
+  tgunlock(p);
+  return ip;
+}
+
+// Make ip, whose reference the caller passes on, the
+// current directory of the current process and of the
+// threads sharing its memory.
+// Must be called inside a transaction since it calls iput().
+void
+setcwd(struct inode *ip)
+{
+  struct proc *p = myproc(), *pp;
+  struct inode *old;
+  int n = 1;
+
+  tglock(p);
+  old = p->cwd;
+  if(p->tg){
+    // every live thread holds a reference to old.
+    for(pp = proc; pp < &proc[NPROC]; pp++){
+      if(pp != p && pp->tg == p->tg && pp->cwd){
+        pp->cwd = idup(ip);
+        n++;
+      }
+    }
+  }
+  p->cwd = ip;
+  tgunlock(p);
+
+  while(n-- > 0)
+    iput(old);
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -351,22 +971,18 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
-    }
-  }
-
-  begin_op();
-  iput(p->cwd);
-  end_op();
-  p->cwd = 0;
+  putfiles(p);
 
   acquire(&wait_lock);
 
+  if(p->vfparent){
+    // wait_lock keeps interrupts off, so nothing can
+    // switch back to the borrowed page table.
+    kvmswitch();
+    vfrelease(p, p->sz);
+    p->pagetable = 0;
+  }
+
   // Give any children to init.
   reparent(p);
 
@@ -385,22 +1001,30 @@ exit(int status)
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
-int
-wait(uint64 addr)
+// Wait for a child to exit and return its pid, copying
+// its exit status to addr unless that is 0. The child is
+// a thread that shares this process's memory (see clone())
+// if thread is set, else a process that doesn't.
+// Return -1 if this process has no such children.
+static int
+waitchild(uint64 addr, int thread)
 {
   struct proc *pp;
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the copyout() below holds locks, so it can't read in
+  // a program page itself.
+  if(addr != 0)
+    vmprefault(p->pagetable, addr, sizeof(int));
+
   acquire(&wait_lock);
 
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
     for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
+      if(pp->parent == p && (pp->tg != 0 && pp->tg == p->tg) == thread){
         // make sure the child isn't still in exit() or swtch().
         acquire(&pp->lock);
 
@@ -434,6 +1058,343 @@ wait(uint64 addr)
   }
 }
 
+// Wait for a child process to exit and return its pid.
+// Return -1 if this process has no children.
+int
+wait(uint64 addr)
+{
+  return waitchild(addr, 0);
+}
+
+// Wait for a thread this process created with clone() to
+// exit, and return its pid. Return -1 if it has none.
+int
+join(void)
+{
+  return waitchild(0, 1);
+}
+
+#ifdef SCHED_VRUNTIME
+// Insert p into rq in vruntime order, behind processes
+// with the same vruntime. A process that has slept
+// starts no lower than minvr, so it can't take a CPU
+// for as long as it was away.
+// Caller must hold p->lock and rq->lock.
+static void
+runqput(struct runq *rq, struct proc *p)
+{
+  struct proc **pp;
+
+  if(p->vruntime < minvr)
+    p->vruntime = minvr;
+  for(pp = &rq->head; *pp && (*pp)->vruntime <= p->vruntime; pp = &(*pp)->rqnext)
+    ;
+  p->rqnext = *pp;
+  *pp = p;
+}
+
+// Remove and return the process with the lowest
+// vruntime on rq, or 0.
+static struct proc*
+runqget(struct runq *rq)
+{
+  struct proc *p;
+  uint64 vr;
+
+  acquire(&rq->lock);
+  if((p = rq->head) != 0){
+    rq->head = p->rqnext;
+    rq->n--;
+    // other CPUs raise minvr under their own queue's lock.
+    while((vr = minvr) < p->vruntime &&
+          !__sync_bool_compare_and_swap(&minvr, vr, p->vruntime))
+      ;
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// The queue whose head has the lowest vruntime, CPU
+// id's own if none is lower. Looks at the heads
+// without their locks, so the answer is only a hint.
+static struct runq*
+runqmin(int id)
+{
+  struct runq *rq = &runqs[id];
+  struct proc *h;
+  uint64 vr = -1;
+  int i;
+
+  for(i = 0; i < NCPU; i++){
+    h = runqs[(id + i) % NCPU].head;
+    if(h && h->vruntime < vr){
+      vr = h->vruntime;
+      rq = &runqs[(id + i) % NCPU];
+    }
+  }
+  return rq;
+}
+
+// Charge p for running d time CSR cycles.
+// Caller must hold p->lock.
+static void
+charge(struct proc *p, uint64 d)
+{
+  p->vruntime += (d << 10) / p->weight;
+}
+
+// Should p, which is running, give up the CPU? Only if
+// its vruntime has passed that of a process waiting on
+// any CPU's queue, which this CPU's scheduler() will
+// then take.
+// Caller must hold p->lock.
+static int
+sliceover(struct proc *p)
+{
+  struct runq *rq;
+  uint64 now = r_time();
+  int r;
+
+  charge(p, now - p->runstart);
+  p->runstart = now;
+  rq = runqmin(p->cpu);
+  acquire(&rq->lock);
+  r = rq->head && rq->head->vruntime < p->vruntime;
+  release(&rq->lock);
+  return r;
+}
+#else
+// Move p back to level 0 if there has been a priority
+// boost since p last had one.
+// Caller must hold p->lock, or the lock of the run
+// queue p is on.
+static void
+boostproc(struct proc *p, uint boost)
+{
+  if(p->boost != boost){
+    p->boost = boost;
+    p->level = 0;
+    p->used = 0;
+  }
+}
+
+// Put p at the tail of its level in rq.
+// Caller must hold p->lock and rq->lock.
+static void
+runqput(struct runq *rq, struct proc *p)
+{
+  boostproc(p, curboost());
+  p->rqnext = 0;
+  if(rq->tail[p->level])
+    rq->tail[p->level]->rqnext = p;
+  else
+    rq->head[p->level] = p;
+  rq->tail[p->level] = p;
+}
+
+// Apply a priority boost to the processes on rq, by moving
+// them all to the tail of level 0.
+// Caller must hold rq->lock.
+static void
+runqboost(struct runq *rq, uint boost)
+{
+  struct proc *p;
+  int l;
+
+  rq->boost = boost;
+  for(l = 0; l < NLEVEL; l++){
+    for(p = rq->head[l]; p; p = p->rqnext)
+      boostproc(p, boost);
+    if(l == 0 || rq->head[l] == 0)
+      continue;
+    if(rq->tail[0])
+      rq->tail[0]->rqnext = rq->head[l];
+    else
+      rq->head[0] = rq->head[l];
+    rq->tail[0] = rq->tail[l];
+    rq->head[l] = rq->tail[l] = 0;
+  }
+}
+
+// Remove and return the process at the head of the
+// lowest non-empty level of rq, or 0.
+static struct proc*
+runqget(struct runq *rq)
+{
+  struct proc *p = 0;
+  uint boost = curboost();
+  int l;
+
+  acquire(&rq->lock);
+  if(rq->boost != boost)
+    runqboost(rq, boost);
+  for(l = 0; l < NLEVEL; l++){
+    if((p = rq->head[l]) != 0){
+      rq->head[l] = p->rqnext;
+      if(rq->head[l] == 0)
+        rq->tail[l] = 0;
+      rq->n--;
+      break;
+    }
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Charge p for running d time CSR cycles.
+// Caller must hold p->lock.
+static void
+charge(struct proc *p, uint64 d)
+{
+  p->used += d;
+}
+
+// Should p, which is running, give up the CPU? Yes if it
+// has used up its level's time slice, which also moves it
+// down a level, or if a process of a lower level is
+// waiting on its CPU.
+// Caller must hold p->lock.
+static int
+sliceover(struct proc *p)
+{
+  struct runq *rq = &runqs[p->cpu];
+  uint64 now = r_time();
+  int l, r = 0;
+
+  boostproc(p, curboost());
+  charge(p, now - p->runstart);
+  p->runstart = now;
+  if(p->used >= SLICE(p->level)){
+    if(p->level < NLEVEL-1)
+      p->level++;
+    p->used = 0;
+    return 1;
+  }
+  acquire(&rq->lock);
+  for(l = 0; l < p->level; l++)
+    if(rq->head[l])
+      r = 1;
+  release(&rq->lock);
+  return r;
+}
+#endif
+
+// Mark p RUNNABLE, and put it on its CPU's run queue.
+// Wake that CPU if it's idle; if it is busy, wake an
+// idle CPU to steal p instead.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *rq = &runqs[p->cpu];
+  struct proc *running;
+  int i, idle, n;
+
+  p->state = RUNNABLE;
+  acquire(&rq->lock);
+  runqput(rq, p);
+  n = ++rq->n;
+  idle = rq->idle;
+  release(&rq->lock);
+
+  if(idle){
+    mcall(MCALL_IPI, p->cpu);
+    return;
+  }
+
+  // a yield() puts p back on its own CPU's empty queue,
+  // and needs no help.
+  running = cpus[p->cpu].proc;
+  if(n == 1 && (running == 0 || running == p))
+    return;
+  for(i = 0; i < NCPU; i++){
+    if(i != p->cpu && runqs[i].idle){
+      mcall(MCALL_IPI, i);
+      break;
+    }
+  }
+}
+
+// Take a process from the longest run queue of a CPU
+// other than id, or return 0 if all are empty.
+static struct proc*
+runqsteal(int id)
+{
+  struct runq *rq = 0;
+  int i, most = 0;
+
+  for(i = 0; i < NCPU; i++){
+    if(i != id && runqs[i].n > most){
+      most = runqs[i].n;
+      rq = &runqs[i];
+    }
+  }
+  return rq ? runqget(rq) : 0;
+}
+
+// Take the next process for CPU id to run, or return 0
+// if there is none.
+static struct proc*
+runqnext(int id)
+{
+  struct proc *p;
+
+#ifdef SCHED_VRUNTIME
+  // another CPU may take runqmin()'s pick first.
+  if((p = runqget(runqmin(id))) == 0 && (p = runqget(&runqs[id])) == 0)
+    p = runqsteal(id);
+#else
+  if((p = runqget(&runqs[id])) == 0)
+    p = runqsteal(id);
+#endif
+  return p;
+}
+
+// Wait for an interrupt, if there's nothing on CPU id's
+// run queue, with the timer set for the earliest timer
+// deadline rather than for the end of a quantum.
+// Returns with interrupts off.
+static void
+idle(int id)
+{
+  struct runq *rq = &runqs[id];
+  uint64 deadline = -1;
+  uint when;
+
+  // setrunnable() looks at rq->idle with rq->lock held,
+  // so it either queued a process before the check for
+  // one here, or will send an interrupt.
+  intr_off();
+  acquire(&rq->lock);
+  if(rq->n > 0){
+    release(&rq->lock);
+    return;
+  }
+  rq->idle = 1;
+  release(&rq->lock);
+
+  acquire(&tickslock);
+  if(timernext(&when))
+    deadline = tickbase + (uint64)when * TICKCYCLES;
+  release(&tickslock);
+  mcall(MCALL_SETTIMER, deadline);
+
+  // wfi returns once an interrupt is pending, even with
+  // interrupts off, so one that came in since the check
+  // is not lost; it's taken when scheduler() turns
+  // interrupts back on.
+  wfi();
+
+  acquire(&rq->lock);
+  rq->idle = 0;
+  release(&rq->lock);
+
+  // no clock interrupts came while this CPU was idle,
+  // so bring ticks up to date and start a quantum.
+  clockintr();
+  mcall(MCALL_SETTIMER, r_time() + QUANTUM);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -446,6 +1407,7 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
 
   c->proc = 0;
   for(;;){
@@ -454,22 +1416,34 @@ scheduler(void)
     // processes are waiting.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    if((p = runqnext(id)) == 0){
+      idle(id);
+      continue;
     }
+
+    // p may still be on its way out of another CPU, which
+    // holds p->lock until it is back in its scheduler.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = id;
+    p->runstart = r_time();
+    c->proc = p;
+    if(p->kfn == 0)
+      uvmswitch(p);
+    swtch(&c->context, &p->context);
+    kvmswitch();
+    charge(p, r_time() - p->runstart);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -506,11 +1480,27 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
 
+// Called from the timer interrupt at the end of each
+// quantum. Give up the CPU if the scheduling policy
+// says the current process has had its turn.
+void
+preempt(void)
+{
+  struct proc *p = myproc();
+
+  acquire(&p->lock);
+  if(sliceover(p)){
+    setrunnable(p);
+    sched();
+  }
+  release(&p->lock);
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void
@@ -535,53 +1525,187 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn();
+  panic("kthread returned");
+}
+
+// The wait queue for chan.
+static struct waitq*
+chanq(void *chan)
+{
+  return &waitqs[((uint64)chan >> 3) % NWAITQ];
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *wq = chanq(chan);
+  struct proc **pp;
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold wq->lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks wq->lock),
   // so it's okay to release lk.
 
+  if(p->wokechan == chan)
+    __sync_fetch_and_add(&wakestats.futile, 1);
+  p->wokechan = 0;
+
+  acquire(&wq->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
-  // Go to sleep.
+  // Go to sleep, at the tail of the queue.
   p->chan = chan;
   p->state = SLEEPING;
+  p->wq = wq;
+  p->wqnext = 0;
+  for(pp = &wq->head; *pp; pp = &(*pp)->wqnext)
+    ;
+  *pp = p;
+  release(&wq->lock);
 
   sched();
 
   // Tidy up.
   p->chan = 0;
+  release(&p->lock);
+
+  // wakeup() takes p off the queue, but kill() and
+  // wakeproc() leave it there.
+  if(p->wq == 0){
+    p->wokechan = chan;
+  } else {
+    acquire(&wq->lock);
+    for(pp = &wq->head; *pp; pp = &(*pp)->wqnext){
+      if(*pp == p){
+        *pp = p->wqnext;
+        break;
+      }
+    }
+    p->wq = 0;
+    release(&wq->lock);
+  }
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
+// Wake the processes sleeping on chan, oldest first;
+// only the first if one is set.
+static void
+wakechan(void *chan, int one)
+{
+  struct waitq *wq = chanq(chan);
+  struct proc *p, **pp;
+  int n = 0;
+
+  if((p = myproc()) != 0)
+    p->wokechan = 0;
+
+  acquire(&wq->lock);
+  for(pp = &wq->head; (p = *pp) != 0; ){
+    acquire(&p->lock);
+    if(p->state == SLEEPING && p->chan == chan) {
+      *pp = p->wqnext;
+      p->wq = 0;
+      setrunnable(p);
+      n++;
+    } else {
+      pp = &p->wqnext;
+    }
+    release(&p->lock);
+    if(one && n > 0)
+      break;
+  }
+  release(&wq->lock);
+  if(n > 0)
+    __sync_fetch_and_add(&wakestats.woken, n);
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void
 wakeup(void *chan)
+{
+  wakechan(chan, 0);
+}
+
+// Wake up the process that has slept longest on chan,
+// for a resource only one waiter can take. Whoever takes
+// it must wakeup_one() again if enough is left for
+// another, since the other sleepers stay asleep.
+// Must be called without any p->lock.
+void
+wakeup_one(void *chan)
+{
+  wakechan(chan, 1);
+}
+
+// Wake p if it is sleeping on chan.
+// Unlike wakeup(), only takes p->lock, so it
+// may be called while holding another proc's lock.
+void
+wakeproc(struct proc *p, void *chan)
+{
+  acquire(&p->lock);
+  if(p->state == SLEEPING && p->chan == chan)
+    setrunnable(p);
+  release(&p->lock);
+}
+
+// Return the priority level of the process with
+// the given pid, or -1 if there is none.
+int
+getlevel(int pid)
 {
   struct proc *p;
+  int level;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED && p->kfn == 0){
+      level = p->level;
       release(&p->lock);
+      return level;
     }
+    release(&p->lock);
   }
+  return -1;
+}
+
+// Set the scheduling weight of the process with the
+// given pid, which the vruntime scheduler uses to divide
+// the CPU. Returns 0, or -1 if there is no such process.
+int
+setweight(int pid, int weight)
+{
+  struct proc *p;
+
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED && p->kfn == 0){
+      p->weight = weight;
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
 }
 
 // Kill the process with the given pid.
@@ -594,11 +1718,11 @@ kill(int pid)
 
   for(p = proc; p < &proc[NPROC]; p++){
     acquire(&p->lock);
-    if(p->pid == pid){
+    if(p->pid == pid && p->kfn == 0){
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
       return 0;
@@ -682,7 +1806,11 @@ procdump(void)
       state = states[p->state];
     else
       state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
+    if(p->kfn)
+      printf("- %s %d [%s]", state, p->level, p->name);
+    else
+      printf("%d %s %d %s", p->pid, state, p->level, p->name);
     printf("\n");
   }
+  printf("wakeups: %d, futile %d\n", (int)wakestats.woken, (int)wakestats.futile);
 }
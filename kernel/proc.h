@@ -24,6 +24,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asid_gen;            // ASID generation of the last flush of the whole TLB
+  uint64 tlbreq;              // TLB flushes tlbshoot() has asked for
+  uint64 tlbdone;             // tlbreq when this CPU last flushed for tlbshoot()
 };
 
 extern struct cpu cpus[NCPU];
@@ -33,15 +36,16 @@ extern struct cpu cpus[NCPU];
 // user page table. not specially mapped in the kernel page table.
 // uservec in trampoline.S saves user registers in the trapframe,
 // then initializes registers from the trapframe's
-// kernel_sp, kernel_hartid, kernel_satp, and jumps to kernel_trap.
+// kernel_sp and kernel_hartid, and jumps to kernel_trap.
 // usertrapret() and userret in trampoline.S set up
 // the trapframe's kernel_*, restore user registers from the
-// trapframe, switch to the user page table, and enter user space.
+// trapframe, and enter user space. the kernel runs on the
+// user page table, so kernel_satp is unused.
 // the trapframe includes callee-saved user registers like s0-s11 because the
 // return-to-user path via usertrapret() doesn't return through
 // the entire kernel call stack.
 struct trapframe {
-  /*   0 */ uint64 kernel_satp;   // kernel page table
+  /*   0 */ uint64 kernel_satp;   // unused
   /*   8 */ uint64 kernel_sp;     // top of process's kernel stack
   /*  16 */ uint64 kernel_trap;   // usertrap()
   /*  24 */ uint64 epc;           // saved user program counter
@@ -81,6 +85,29 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A program segment that exec() recorded but did not read:
+// vmfault() reads its pages from the executable on first touch.
+// Pages past fileend are zero-filled.
+struct vma {
+  uint64 start;                // First address, page-aligned
+  uint64 fileend;              // End of the file-backed part
+  uint64 end;                  // End of the segment
+  uint off;                    // File offset of start
+  int perm;                    // PTE_ bits to map the pages with
+  struct inode *ip;            // The executable; 0 if slot unused
+};
+
+// State shared by the threads that clone() creates and
+// the process that created them, which all run on one
+// page table.
+struct tgroup {
+  struct spinlock lock;        // protects the group's fields, page table and p->sz
+  int ref;                     // procs using the page table, zombies included
+  int nlive;                   // procs that haven't exited
+  int pid;                     // pid of the first proc, getpid() in every member
+  struct file *ofile[NOFILE];  // Open files of every member
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -91,17 +118,48 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU whose run queue p goes on
+  int level;                   // Priority level; level 0 runs first
+  uint boost;                  // Priority boost p last had, in ticks/BOOSTTICKS
+  uint64 used;                 // Time CSR cycles run at this level
+  uint64 runstart;             // Time CSR value when p last started running
+  uint64 vruntime;             // Time run, scaled down by weight
+  int weight;                  // Share of the CPU, for the vruntime scheduler
+
+  // p's wait queue's lock must be held when using these:
+  struct waitq *wq;            // Wait queue p is on, or 0
+  struct proc *wqnext;         // Next process in the wait queue
+
+  // private to the process, so no lock is needed:
+  void *wokechan;              // Channel of the last wakeup, for futile wakeup stats
+  int nsleeplock;              // Number of sleeplocks held
+
+  // p's run queue's lock must be held when using this:
+  struct proc *rqnext;         // Next RUNNABLE process in the queue
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
+  struct proc *vfparent;       // vfork() parent whose memory this borrows, else 0
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
+  struct usyscall *usyscall;   // read-only data page for user space
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
+  struct file **ofile;         // Open files: files, or tg->ofile
+  struct file *files[NOFILE];  // Open files, when not shared
+  struct inode *cwd;           // Current directory, the same in every thread
+  struct vma vma[NVMA];        // Segments of the program
+  struct tgroup *tg;           // Threads sharing pagetable, or 0
+  uint64 tfva;                 // User address of trapframe
+  uint64 stackbase;            // Lowest address the user stack may grow down to
+  uint64 stacktop;             // Top of the user stack
+  uint64 stacklimit;           // Stack size for the next exec()
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // Body of a kernel thread, else 0
+  uint64 asid;                 // Address space ID of pagetable
+  uint64 asid_gen;             // Generation asid belongs to; 0 if none
+  int tlbstale;                // CPUs that may hold stale TLB entries for asid
 };
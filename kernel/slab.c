@@ -0,0 +1,359 @@
+// Slab allocator for small, fixed-size kernel objects.
+//
+// Each kmem_cache hands out objects of one size. Objects are
+// carved out of one-page slabs obtained from kalloc(); the
+// struct slab header sits at the start of the page, so the
+// slab owning an object is found by rounding the object's
+// address down to a page boundary.
+//
+// A cache keeps its slabs on three lists: partial (some free
+// objects), full (none free) and empty (all free). At most one
+// empty slab is kept; further empty slabs go back to kalloc.
+//
+// In front of the slabs each CPU has a small magazine of free
+// objects, so that most allocations and frees only take that
+// CPU's magazine lock. A CPU moves objects between its magazine
+// and the slabs MAGSIZE/2 at a time.
+//
+// kalloc() calls slabreap() when it runs out of memory, which
+// empties every magazine and frees every empty slab. So no
+// lock in this file may be held while calling kalloc().
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NCACHE  16   // max number of caches
+#define MAGSIZE 16   // objects per per-CPU magazine
+#define NBATCH  (MAGSIZE/2)
+
+struct slab {
+  struct slab *next;
+  struct slab *prev;
+  void *freelist;    // free objects, linked through their first word
+  int inuse;         // objects not on freelist
+};
+
+struct magazine {
+  struct spinlock lock;
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;         // object size, rounded up to 8 bytes
+  int perslab;       // objects per slab
+  struct spinlock lock;
+  struct slab partial;   // list heads
+  struct slab full;
+  struct slab empty;
+  int nslab;             // slabs on all three lists
+  int nempty;
+  struct magazine mag[NCPU];
+};
+
+// objects start after the slab header.
+#define SLABHDR ((sizeof(struct slab) + 7) & ~7)
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NCACHE];
+  int n;
+} slabs;
+
+static void
+listinit(struct slab *h)
+{
+  h->next = h;
+  h->prev = h;
+}
+
+static void
+listremove(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+static void
+listpush(struct slab *h, struct slab *s)
+{
+  s->next = h->next;
+  s->prev = h;
+  h->next->prev = s;
+  h->next = s;
+}
+
+void
+slabinit(void)
+{
+  initlock(&slabs.lock, "slabs");
+}
+
+// Create a cache of objects of the given size.
+// name must be a string constant.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(size < sizeof(void*) || size > PGSIZE - SLABHDR)
+    panic("kmem_cache_create: size");
+
+  acquire(&slabs.lock);
+  if(slabs.n >= NCACHE)
+    panic("kmem_cache_create: too many caches");
+  c = &slabs.cache[slabs.n++];
+  release(&slabs.lock);
+
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+  initlock(&c->lock, name);
+  listinit(&c->partial);
+  listinit(&c->full);
+  listinit(&c->empty);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&c->mag[i].lock, name);
+  return c;
+}
+
+// Turn the page at pa into an empty slab of c.
+// Caller must hold c->lock.
+static void
+slabadd(struct kmem_cache *c, char *pa)
+{
+  struct slab *s = (struct slab*)pa;
+  char *obj;
+
+  s->freelist = 0;
+  s->inuse = 0;
+  for(int i = c->perslab - 1; i >= 0; i--){
+    obj = pa + SLABHDR + i * c->size;
+    *(void**)obj = s->freelist;
+    s->freelist = obj;
+  }
+  listpush(&c->empty, s);
+  c->nslab++;
+  c->nempty++;
+}
+
+// Take up to n free objects out of c's slabs.
+// Caller must hold c->lock.
+static int
+slabget(struct kmem_cache *c, void **obj, int n)
+{
+  struct slab *s;
+  int i = 0;
+
+  while(i < n){
+    if(c->partial.next != &c->partial){
+      s = c->partial.next;
+    } else if(c->empty.next != &c->empty){
+      s = c->empty.next;
+      listremove(s);
+      listpush(&c->partial, s);
+      c->nempty--;
+    } else {
+      break;
+    }
+    while(i < n && s->freelist){
+      obj[i++] = s->freelist;
+      s->freelist = *(void**)s->freelist;
+      s->inuse++;
+    }
+    if(s->freelist == 0){
+      listremove(s);
+      listpush(&c->full, s);
+    }
+  }
+  return i;
+}
+
+// Return obj to its slab. If that leaves a second empty
+// slab, the page goes back to kalloc.
+// Caller must hold c->lock.
+static void
+slabput(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+
+  if(s->inuse <= 0)
+    panic("slabput");
+  *(void**)obj = s->freelist;
+  s->freelist = obj;
+  if(s->inuse-- == c->perslab){
+    listremove(s);
+    listpush(&c->partial, s);
+  }
+  if(s->inuse == 0){
+    listremove(s);
+    if(c->nempty > 0){
+      c->nslab--;
+      kfree((char*)s);
+    } else {
+      listpush(&c->empty, s);
+      c->nempty++;
+    }
+  }
+}
+
+// Allocate an object from cache c.
+// Returns 0 if the memory cannot be allocated.
+// The contents of the object are undefined.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj[NBATCH];
+  char *pa;
+  int n;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n > 0){
+    obj[0] = m->obj[--m->n];
+    release(&m->lock);
+    pop_off();
+    return obj[0];
+  }
+  release(&m->lock);
+  pop_off();
+
+  // the magazine is empty; take a batch from the slabs.
+  acquire(&c->lock);
+  n = slabget(c, obj, NBATCH);
+  release(&c->lock);
+  if(n == 0){
+    // kalloc() may call slabreap(), so no locks here.
+    if((pa = kalloc()) == 0)
+      return 0;
+    acquire(&c->lock);
+    slabadd(c, pa);
+    n = slabget(c, obj, NBATCH);
+    release(&c->lock);
+  }
+
+  // keep all but one in this CPU's magazine, which
+  // may have been refilled while no lock was held.
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  while(n > 1 && m->n < MAGSIZE)
+    m->obj[m->n++] = obj[--n];
+  release(&m->lock);
+  pop_off();
+
+  if(n > 1){
+    acquire(&c->lock);
+    while(n > 1)
+      slabput(c, obj[--n]);
+    release(&c->lock);
+  }
+  return obj[0];
+}
+
+// Free an object that was allocated from cache c.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+  void *old[NBATCH];
+  int n = 0;
+
+  if(obj == 0 || (uint64)obj % 8 != 0)
+    panic("kmem_cache_free");
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n == MAGSIZE){
+    // make room by moving a batch back to the slabs.
+    for(; n < NBATCH; n++)
+      old[n] = m->obj[--m->n];
+  }
+  m->obj[m->n++] = obj;
+  release(&m->lock);
+  pop_off();
+
+  if(n > 0){
+    acquire(&c->lock);
+    while(n > 0)
+      slabput(c, old[--n]);
+    release(&c->lock);
+  }
+}
+
+// Give every free object in magazines back to its slab,
+// and every empty slab back to kalloc.
+// Called by kalloc() when memory runs out.
+// Returns the number of pages freed.
+int
+slabreap(void)
+{
+  struct kmem_cache *c;
+  struct magazine *m;
+  struct slab *s;
+  void *obj[MAGSIZE];
+  int i, n, ncache, freed = 0;
+
+  acquire(&slabs.lock);
+  ncache = slabs.n;
+  release(&slabs.lock);
+
+  for(c = slabs.cache; c < slabs.cache + ncache; c++){
+    for(i = 0; i < NCPU; i++){
+      m = &c->mag[i];
+      acquire(&m->lock);
+      for(n = 0; m->n > 0; n++)
+        obj[n] = m->obj[--m->n];
+      release(&m->lock);
+
+      acquire(&c->lock);
+      while(n > 0)
+        slabput(c, obj[--n]);
+      release(&c->lock);
+    }
+
+    acquire(&c->lock);
+    while(c->empty.next != &c->empty){
+      s = c->empty.next;
+      listremove(s);
+      c->nempty--;
+      c->nslab--;
+      kfree((char*)s);
+      freed++;
+    }
+    release(&c->lock);
+  }
+  return freed;
+}
+
+// Print each cache's size and slab usage to the console.
+// For debugging. No locks, like procdump().
+void
+slabdump(void)
+{
+  struct kmem_cache *c;
+  struct slab *s;
+  int inuse, cached;
+
+  for(c = slabs.cache; c < slabs.cache + slabs.n; c++){
+    inuse = 0;
+    for(s = c->partial.next; s != &c->partial; s = s->next)
+      inuse += s->inuse;
+    for(s = c->full.next; s != &c->full; s = s->next)
+      inuse += s->inuse;
+    cached = 0;
+    for(int i = 0; i < NCPU; i++)
+      cached += c->mag[i].n;
+    printf("slab: %s: %d bytes, %d in use, %d in magazines, %d slabs\n",
+           c->name, c->size, inuse - cached, cached, c->nslab);
+  }
+}
@@ -27,6 +27,7 @@ acquiresleep(struct sleeplock *lk)
   }
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  myproc()->nsleeplock++;
   release(&lk->lk);
 }
 
@@ -36,7 +37,9 @@ releasesleep(struct sleeplock *lk)
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
-  wakeup(lk);
+  myproc()->nsleeplock--;
+  // only one waiter can get the lock.
+  wakeup_one(lk);
   release(&lk->lk);
 }
 
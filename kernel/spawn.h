@@ -0,0 +1,16 @@
+// File actions for spawn(). The new process starts with
+// the caller's open files; the actions are then applied
+// to them in order. A list ends with an op of 0.
+#define SPAWN_DUP2  1  // make newfd refer to fd's file
+#define SPAWN_CLOSE 2  // close fd
+#define SPAWN_OPEN  3  // open path with mode as newfd
+
+#define MAXSPAWNACT 8  // max actions, including the end
+
+struct spawnact {
+  int op;
+  int fd;
+  int newfd;
+  int mode;
+  char *path;
+};
@@ -29,8 +29,10 @@ acquire(struct spinlock *lk)
   //   a5 = 1
   //   s1 = &lk->locked
   //   amoswap.w.aq a5, a5, (s1)
+  // the holder may be waiting in tlbshoot() for this
+  // CPU, which has interrupts off, to flush its TLB.
   while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+    tlbpoll();
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -81,6 +83,19 @@ holding(struct spinlock *lk)
   return r;
 }
 
+// Is this cpu holding any spinlock? If not, the caller
+// may sleep.
+int
+holdingany(void)
+{
+  int r;
+
+  push_off();
+  r = mycpu()->noff > 1;
+  pop_off();
+  return r;
+}
+
 // push_off/pop_off are like intr_off()/intr_on() except that they are matched:
 // it takes two pop_off()s to undo two push_off()s.  Also, if interrupts
 // are initially off, then push_off, pop_off leaves them off.
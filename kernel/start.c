@@ -11,9 +11,12 @@ void timerinit();
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
 // a scratch area per CPU for machine-mode timer interrupts.
-uint64 timer_scratch[NCPU][5];
+uint64 timer_scratch[NCPU][6];
 
-// assembly code in kernelvec.S for machine-mode timer interrupt.
+// the time when hart 0's clock started ticking.
+uint64 tickbase;
+
+// assembly code in kernelvec.S for machine-mode traps.
 extern void timervec();
 
 // entry.S jumps here in machine mode on stack0.
@@ -33,8 +36,9 @@ start()
   // disable paging for now.
   w_satp(0);
 
-  // delegate all interrupts and exceptions to supervisor mode.
-  w_medeleg(0xffff);
+  // delegate all interrupts and exceptions to supervisor mode,
+  // except ecalls from supervisor mode, which are mcall()s.
+  w_medeleg(0xffff & ~(1 << 9));
   w_mideleg(0xffff);
   w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
@@ -43,6 +47,11 @@ start()
   w_pmpaddr0(0x3fffffffffffffull);
   w_pmpcfg0(0xf);
 
+  // let supervisor and user mode read the time CSR,
+  // for the usyscall page's clock.
+  w_mcounteren(r_mcounteren() | COUNTEREN_TM);
+  w_scounteren(r_scounteren() | COUNTEREN_TM);
+
   // ask for clock interrupts.
   timerinit();
 
@@ -57,8 +66,11 @@ start()
 // arrange to receive timer interrupts.
 // they will arrive in machine mode at
 // at timervec in kernelvec.S,
-// which turns them into software interrupts for
-// devintr() in trap.c.
+// which turns them into supervisor timer interrupts
+// for devintr() in trap.c. there's no fixed interval:
+// the kernel asks for each interrupt with mcall(),
+// at the end of a quantum or, on an idle CPU, at the
+// next timer deadline.
 void
 timerinit()
 {
@@ -66,16 +78,19 @@ timerinit()
   int id = r_mhartid();
 
   // ask the CLINT for a timer interrupt.
-  int interval = 1000000; // cycles; about 1/10th second in qemu.
-  *(uint64*)CLINT_MTIMECMP(id) = *(uint64*)CLINT_MTIME + interval;
+  if(id == 0)
+    tickbase = *(uint64*)CLINT_MTIME;
+  *(uint64*)CLINT_MTIMECMP(id) = *(uint64*)CLINT_MTIME + QUANTUM;
 
   // prepare information in scratch[] for timervec.
   // scratch[0..2] : space for timervec to save registers.
   // scratch[3] : address of CLINT MTIMECMP register.
-  // scratch[4] : desired interval (in cycles) between timer interrupts.
+  // scratch[4] : address of CLINT MSIP register.
+  // scratch[5] : address of hart 0's CLINT MSIP register.
   uint64 *scratch = &timer_scratch[id][0];
   scratch[3] = CLINT_MTIMECMP(id);
-  scratch[4] = interval;
+  scratch[4] = CLINT_MSIP(id);
+  scratch[5] = CLINT_MSIP(0);
   w_mscratch((uint64)scratch);
 
   // set the machine-mode trap handler.
@@ -84,6 +99,6 @@ timerinit()
   // enable machine-mode interrupts.
   w_mstatus(r_mstatus() | MSTATUS_MIE);
 
-  // enable machine-mode timer interrupts.
-  w_mie(r_mie() | MIE_MTIE);
+  // enable machine-mode timer and software interrupts.
+  w_mie(r_mie() | MIE_MTIE | MIE_MSIE);
 }
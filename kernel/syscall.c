@@ -101,6 +101,13 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_vfork(void);
+extern uint64 sys_stacklimit(void);
+extern uint64 sys_getlevel(void);
+extern uint64 sys_setweight(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -126,6 +133,13 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_spawn]   sys_spawn,
+[SYS_vfork]   sys_vfork,
+[SYS_stacklimit] sys_stacklimit,
+[SYS_getlevel] sys_getlevel,
+[SYS_setweight] sys_setweight,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
 };
 
 void
@@ -20,3 +20,10 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_spawn  22
+#define SYS_vfork  23
+#define SYS_stacklimit 24
+#define SYS_getlevel 25
+#define SYS_setweight 26
+#define SYS_clone  27
+#define SYS_join   28
@@ -15,17 +15,28 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "spawn.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
+// If threads share the descriptors (see clone()), the file comes
+// with a reference of its own, so that a close() in another thread
+// can't free it; the caller must drop it with fdput().
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
   int fd;
   struct file *f;
+  struct proc *p = myproc();
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE)
+    return -1;
+  tglock(p);
+  if((f = p->ofile[fd]) != 0 && p->tg)
+    filedup(f);
+  tgunlock(p);
+  if(f == 0)
     return -1;
   if(pfd)
     *pfd = fd;
@@ -34,6 +45,14 @@ argfd(int n, int *pfd, struct file **pf)
   return 0;
 }
 
+// Drop the reference argfd() took on f, if any.
+static void
+fdput(struct file *f)
+{
+  if(myproc()->tg)
+    fileclose(f);
+}
+
 // Allocate a file descriptor for the given file.
 // Takes over file reference from caller on success.
 static int
@@ -42,15 +61,35 @@ fdalloc(struct file *f)
   int fd;
   struct proc *p = myproc();
 
+  tglock(p);
   for(fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd] == 0){
       p->ofile[fd] = f;
+      tgunlock(p);
       return fd;
     }
   }
+  tgunlock(p);
   return -1;
 }
 
+// Free file descriptor fd, if it still refers to f.
+// Returns 0, or -1 if another thread closed it first.
+static int
+fdfree(int fd, struct file *f)
+{
+  struct proc *p = myproc();
+  int r = -1;
+
+  tglock(p);
+  if(p->ofile[fd] == f){
+    p->ofile[fd] = 0;
+    r = 0;
+  }
+  tgunlock(p);
+  return r;
+}
+
 uint64
 sys_dup(void)
 {
@@ -59,9 +98,12 @@ sys_dup(void)
 
   if(argfd(0, 0, &f) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
+  if((fd=fdalloc(f)) < 0){
+    fdput(f);
     return -1;
+  }
   filedup(f);
+  fdput(f);
   return fd;
 }
 
@@ -76,7 +118,9 @@ sys_read(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
-  return fileread(f, p, n);
+  n = fileread(f, p, n);
+  fdput(f);
+  return n;
 }
 
 uint64
@@ -91,7 +135,9 @@ sys_write(void)
   if(argfd(0, 0, &f) < 0)
     return -1;
 
-  return filewrite(f, p, n);
+  n = filewrite(f, p, n);
+  fdput(f);
+  return n;
 }
 
 uint64
@@ -102,8 +148,12 @@ sys_close(void)
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  if(fdfree(fd, f) < 0){
+    fdput(f);
+    return -1;
+  }
   fileclose(f);
+  fdput(f);
   return 0;
 }
 
@@ -113,10 +163,14 @@ sys_fstat(void)
   struct file *f;
   uint64 st; // user pointer to struct stat
 
+  int r;
+
   argaddr(1, &st);
   if(argfd(0, 0, &f) < 0)
     return -1;
-  return filestat(f, st);
+  r = filestat(f, st);
+  fdput(f);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -253,6 +307,8 @@ create(char *path, short type, short major, short minor)
 
   ilock(dp);
 
+  // if dirlookup() fails for want of memory, dirlink()
+  // below finds name and the create fails.
   if((ip = dirlookup(dp, name, 0)) != 0){
     iunlockput(dp);
     ilock(ip);
@@ -301,18 +357,12 @@ create(char *path, short type, short major, short minor)
   return 0;
 }
 
-uint64
-sys_open(void)
+// Open path in mode omode. Returns the open file, or 0.
+static struct file*
+fileopen(char *path, int omode)
 {
-  char path[MAXPATH];
-  int fd, omode;
   struct file *f;
   struct inode *ip;
-  int n;
-
-  argint(1, &omode);
-  if((n = argstr(0, path, MAXPATH)) < 0)
-    return -1;
 
   begin_op();
 
@@ -320,33 +370,31 @@ sys_open(void)
     ip = create(path, T_FILE, 0, 0);
     if(ip == 0){
       end_op();
-      return -1;
+      return 0;
     }
   } else {
     if((ip = namei(path)) == 0){
       end_op();
-      return -1;
+      return 0;
     }
     ilock(ip);
     if(ip->type == T_DIR && omode != O_RDONLY){
       iunlockput(ip);
       end_op();
-      return -1;
+      return 0;
     }
   }
 
   if(ip->type == T_DEVICE && (ip->major < 0 || ip->major >= NDEV)){
     iunlockput(ip);
     end_op();
-    return -1;
+    return 0;
   }
 
-  if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
-    if(f)
-      fileclose(f);
+  if((f = filealloc()) == 0){
     iunlockput(ip);
     end_op();
-    return -1;
+    return 0;
   }
 
   if(ip->type == T_DEVICE){
@@ -367,6 +415,26 @@ sys_open(void)
   iunlock(ip);
   end_op();
 
+  return f;
+}
+
+uint64
+sys_open(void)
+{
+  char path[MAXPATH];
+  int fd, omode;
+  struct file *f;
+
+  argint(1, &omode);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+
+  if((f = fileopen(path, omode)) == 0)
+    return -1;
+  if((fd = fdalloc(f)) < 0){
+    fileclose(f);
+    return -1;
+  }
   return fd;
 }
 
@@ -411,7 +479,6 @@ sys_chdir(void)
 {
   char path[MAXPATH];
   struct inode *ip;
-  struct proc *p = myproc();
   
   begin_op();
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
@@ -425,26 +492,29 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(p->cwd);
+  setcwd(ip);
   end_op();
-  p->cwd = ip;
   return 0;
 }
 
-uint64
-sys_exec(void)
+static void
+freeargv(char **argv)
+{
+  for(int i = 0; i < MAXARG && argv[i] != 0; i++)
+    kfree(argv[i]);
+}
+
+// Fetch the user argv array at uargv into kernel pages.
+// Returns 0, or -1 after freeing what was fetched.
+static int
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  argaddr(1, &uargv);
-  if(argstr(0, path, MAXPATH) < 0) {
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG * sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
+    if(i >= MAXARG){
       goto bad;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
@@ -460,17 +530,114 @@ sys_exec(void)
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
       goto bad;
   }
+  return 0;
 
-  int ret = exec(path, argv);
+ bad:
+  freeargv(argv);
+  return -1;
+}
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+
+  argaddr(1, &uargv);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  int ret = exec(path, argv);
 
+  freeargv(argv);
   return ret;
+}
+
+// Apply spawn() file actions to a new process's
+// open files. Returns 0, or -1 if an action failed.
+int
+spawnfiles(struct file **ofile, struct spawnact *act, int nact)
+{
+  struct spawnact *a;
+  struct file *f;
+
+  for(a = act; a < act + nact; a++){
+    if(a->op != SPAWN_CLOSE && (a->newfd < 0 || a->newfd >= NOFILE))
+      return -1;
+    switch(a->op){
+    case SPAWN_DUP2:
+      if(a->fd < 0 || a->fd >= NOFILE || ofile[a->fd] == 0)
+        return -1;
+      if(a->fd == a->newfd)
+        break;
+      f = filedup(ofile[a->fd]);
+      if(ofile[a->newfd])
+        fileclose(ofile[a->newfd]);
+      ofile[a->newfd] = f;
+      break;
+    case SPAWN_CLOSE:
+      if(a->fd < 0 || a->fd >= NOFILE || ofile[a->fd] == 0)
+        return -1;
+      fileclose(ofile[a->fd]);
+      ofile[a->fd] = 0;
+      break;
+    case SPAWN_OPEN:
+      if((f = fileopen(a->path, a->mode)) == 0)
+        return -1;
+      if(ofile[a->newfd])
+        fileclose(ofile[a->newfd]);
+      ofile[a->newfd] = f;
+      break;
+    default:
+      return -1;
+    }
+  }
+  return 0;
+}
+
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG], *paths;
+  struct spawnact act[MAXSPAWNACT];
+  uint64 uargv, uact;
+  int n, pid;
+
+  argaddr(1, &uargv);
+  argaddr(2, &uact);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+
+  // room for the paths of SPAWN_OPEN actions.
+  if((paths = kalloc()) == 0)
+    return -1;
+  for(n = 0; uact != 0; n++){
+    if(n >= MAXSPAWNACT)
+      goto bad;
+    if(copyin(myproc()->pagetable, (char*)&act[n], uact + n*sizeof(act[0]), sizeof(act[0])) < 0)
+      goto bad;
+    if(act[n].op == 0)
+      break;
+    if(act[n].op == SPAWN_OPEN){
+      if(fetchstr((uint64)act[n].path, paths + n*MAXPATH, MAXPATH) < 0)
+        goto bad;
+      act[n].path = paths + n*MAXPATH;
+    }
+  }
+  if(fetchargv(uargv, argv) < 0)
+    goto bad;
+
+  pid = spawn(path, argv, act, n);
+
+  freeargv(argv);
+  kfree(paths);
+  return pid;
 
  bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+  kfree(paths);
   return -1;
 }
 
@@ -488,15 +655,15 @@ sys_pipe(void)
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      p->ofile[fd0] = 0;
+      fdfree(fd0, rf);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
+    fdfree(fd0, rf);
+    fdfree(fd1, wf);
     fileclose(rf);
     fileclose(wf);
     return -1;
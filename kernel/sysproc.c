@@ -18,7 +18,10 @@ sys_exit(void)
 uint64
 sys_getpid(void)
 {
-  return myproc()->pid;
+  struct proc *p = myproc();
+
+  // the thread group's pid, which ugetpid() reads too.
+  return p->tg ? p->tg->pid : p->pid;
 }
 
 uint64
@@ -27,6 +30,12 @@ sys_fork(void)
   return fork();
 }
 
+uint64
+sys_vfork(void)
+{
+  return vfork();
+}
+
 uint64
 sys_wait(void)
 {
@@ -35,39 +44,81 @@ sys_wait(void)
   return wait(p);
 }
 
+uint64
+sys_clone(void)
+{
+  uint64 fn, stack, arg;
+
+  argaddr(0, &fn);
+  argaddr(1, &stack);
+  argaddr(2, &arg);
+  return clone(fn, stack, arg);
+}
+
+uint64
+sys_join(void)
+{
+  return join();
+}
+
 uint64
 sys_sbrk(void)
 {
-  uint64 addr;
   int n;
 
   argint(0, &n);
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  return growproc(n);
+}
+
+// Set the size of the stack that exec() reserves for
+// this process and the children it creates from now on,
+// or leave it if the argument is 0. Returns the old size.
+uint64
+sys_stacklimit(void)
+{
+  struct proc *p = myproc();
+  uint64 old = p->stacklimit;
+  int n;
+
+  argint(0, &n);
+  if(n < 0 || n > MAXUVA/2)
     return -1;
-  return addr;
+  if(n > 0)
+    p->stacklimit = PGROUNDUP(n);
+  return old;
 }
 
 uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   argint(0, &n);
-  if(n < 0)
-    n = 0;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(killed(myproc())){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  return ticksleep(n);
+}
+
+// return the scheduling priority level of process pid.
+uint64
+sys_getlevel(void)
+{
+  int pid;
+
+  argint(0, &pid);
+  return getlevel(pid);
+}
+
+// set the scheduling weight of process pid,
+// from 1 to MAXWEIGHT.
+uint64
+sys_setweight(void)
+{
+  int pid, weight;
+
+  argint(0, &pid);
+  argint(1, &weight);
+  if(weight < 1 || weight > MAXWEIGHT)
+    return -1;
+  return setweight(pid, weight);
 }
 
 uint64
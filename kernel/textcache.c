@@ -0,0 +1,211 @@
+// Cache of the read-only pages of executables.
+//
+// vmfault() reads in a page of a program segment the first
+// time a process touches it. Pages of segments that are not
+// writable (the text and read-only data) are also entered
+// here, keyed by the executable's device, inode number and
+// file offset, so that every process running the program
+// maps the same physical page, and an exec() of a program
+// that ran recently reads nothing from the disk.
+//
+// The cache holds one reference on each page (see kref()),
+// and each mapping another. Entries are keyed by inode
+// number rather than by in-memory inode, so they outlive
+// the last iput() between two runs of a program. They are
+// dropped when the file is written or truncated, which
+// includes its being freed, and by textreap() when kalloc()
+// runs out of memory.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+
+#define NTHASH 31
+
+// a cached page.
+struct tpage {
+  uint dev;
+  uint inum;
+  uint off;            // file offset of the page's contents
+  int n;               // bytes from the file; the rest is zero
+  char *pa;
+  struct tpage *next;  // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct tpage *hash[NTHASH];  // chained on dev and inum
+  int n;                       // cached pages
+  uint64 hits;
+  uint64 misses;
+} tcache;
+
+static struct kmem_cache *tpagecache;
+
+static inline struct tpage **
+thash(uint dev, uint inum)
+{
+  return &tcache.hash[(dev * 31 + inum) % NTHASH];
+}
+
+void
+textinit(void)
+{
+  initlock(&tcache.lock, "tcache");
+  tpagecache = kmem_cache_create("tpage", sizeof(struct tpage));
+}
+
+// Return the cached page holding n bytes of ip at offset
+// off, with a reference for the caller, or 0.
+char *
+textget(struct inode *ip, uint off, int n)
+{
+  struct tpage *t;
+  char *pa = 0;
+
+  acquire(&tcache.lock);
+  for(t = *thash(ip->dev, ip->inum); t; t = t->next){
+    if(t->dev == ip->dev && t->inum == ip->inum && t->off == off && t->n == n){
+      pa = t->pa;
+      kref(pa);
+      break;
+    }
+  }
+  if(pa)
+    tcache.hits++;
+  else
+    tcache.misses++;
+  release(&tcache.lock);
+  return pa;
+}
+
+// Enter page pa, just read from n bytes of ip at offset
+// off, into the cache. Returns the page the caller should
+// map: pa, or the page another process entered first, in
+// which case pa is freed. Either way the caller keeps one
+// reference. If there's no memory for the entry, pa just
+// stays private.
+char *
+textput(struct inode *ip, uint off, int n, char *pa)
+{
+  struct tpage *t, *nt, **h;
+
+  // kmem_cache_alloc() may call textreap(), so no lock yet.
+  if((nt = kmem_cache_alloc(tpagecache)) == 0)
+    return pa;
+
+  acquire(&tcache.lock);
+  h = thash(ip->dev, ip->inum);
+  for(t = *h; t; t = t->next){
+    if(t->dev == ip->dev && t->inum == ip->inum && t->off == off && t->n == n){
+      kref(t->pa);
+      release(&tcache.lock);
+      kmem_cache_free(tpagecache, nt);
+      kfree(pa);
+      return t->pa;
+    }
+  }
+  nt->dev = ip->dev;
+  nt->inum = ip->inum;
+  nt->off = off;
+  nt->n = n;
+  nt->pa = pa;
+  kref(pa);
+  nt->next = *h;
+  *h = nt;
+  tcache.n++;
+  release(&tcache.lock);
+  return pa;
+}
+
+// Drop the cached pages of ip, whose contents are
+// about to change. Processes mapping them keep them.
+void
+textevict(struct inode *ip)
+{
+  struct tpage *t, **pp, *freed = 0;
+
+  acquire(&tcache.lock);
+  for(pp = thash(ip->dev, ip->inum); (t = *pp) != 0; ){
+    if(t->dev == ip->dev && t->inum == ip->inum){
+      *pp = t->next;
+      t->next = freed;
+      freed = t;
+      tcache.n--;
+    } else {
+      pp = &t->next;
+    }
+  }
+  release(&tcache.lock);
+
+  while((t = freed) != 0){
+    freed = t->next;
+    kfree(t->pa);
+    kmem_cache_free(tpagecache, t);
+  }
+}
+
+// Free the cached pages that no process maps.
+// Called by kalloc() when it runs out of memory.
+// Returns the number of pages freed.
+int
+textreap(void)
+{
+  struct tpage *t, **pp, *freed = 0;
+  int i, n = 0;
+
+  acquire(&tcache.lock);
+  for(i = 0; i < NTHASH; i++){
+    for(pp = &tcache.hash[i]; (t = *pp) != 0; ){
+      if(krefcnt(t->pa) == 1){
+        *pp = t->next;
+        t->next = freed;
+        freed = t;
+        tcache.n--;
+      } else {
+        pp = &t->next;
+      }
+    }
+  }
+  release(&tcache.lock);
+
+  while((t = freed) != 0){
+    freed = t->next;
+    kfree(t->pa);
+    kmem_cache_free(tpagecache, t);
+    n++;
+  }
+  return n;
+}
+
+// Number of cached pages that textreap() could free.
+// Only a hint, like kfreecount().
+int
+textfree(void)
+{
+  struct tpage *t;
+  int i, n = 0;
+
+  acquire(&tcache.lock);
+  for(i = 0; i < NTHASH; i++)
+    for(t = tcache.hash[i]; t; t = t->next)
+      if(krefcnt(t->pa) == 1)
+        n++;
+  release(&tcache.lock);
+  return n;
+}
+
+// Print the cache's size and hit rate to the console.
+// For debugging.
+void
+textdump(void)
+{
+  printf("text: %d cached pages, %d hits, %d misses\n",
+         tcache.n, (int)tcache.hits, (int)tcache.misses);
+}
@@ -0,0 +1,155 @@
+// Timers, for sleeping until a given tick.
+//
+// Pending timers are kept in a min-heap ordered by deadline,
+// so clockintr() looks only at the timers that are due
+// instead of waking every sleeping process on every tick to
+// check its own deadline. A timer that is due is taken out
+// of the heap and wakeup() is called on it.
+//
+// tickslock protects the heap and the timers in it. A
+// caller sleeps on its timer with tickslock, and stops the
+// timer if it gives up waiting before the deadline.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "timer.h"
+
+#define NTIMER (2*NPROC)
+
+struct {
+  struct timer *heap[NTIMER];  // heap[0] is due first
+  int n;
+} timers;
+
+// does tick a come before tick b? copes with wrap-around.
+static inline int
+before(uint a, uint b)
+{
+  return (int)(a - b) < 0;
+}
+
+static void
+put(int i, struct timer *t)
+{
+  timers.heap[i] = t;
+  t->i = i;
+}
+
+// move the timer at i up the heap to where it belongs.
+static void
+up(int i)
+{
+  struct timer *t = timers.heap[i];
+
+  while(i > 0 && before(t->when, timers.heap[(i-1)/2]->when)){
+    put(i, timers.heap[(i-1)/2]);
+    i = (i-1)/2;
+  }
+  put(i, t);
+}
+
+// move the timer at i down the heap to where it belongs.
+static void
+down(int i)
+{
+  struct timer *t = timers.heap[i];
+  int c;
+
+  while((c = 2*i + 1) < timers.n){
+    if(c+1 < timers.n && before(timers.heap[c+1]->when, timers.heap[c]->when))
+      c++;
+    if(!before(timers.heap[c]->when, t->when))
+      break;
+    put(i, timers.heap[c]);
+    i = c;
+  }
+  put(i, t);
+}
+
+// Start timer t, to expire at tick when.
+// Caller must hold tickslock.
+void
+timerstart(struct timer *t, uint when)
+{
+  if(timers.n >= NTIMER)
+    panic("timerstart");
+  t->when = when;
+  put(timers.n++, t);
+  up(t->i);
+}
+
+// Stop timer t, if it hasn't expired yet.
+// Caller must hold tickslock.
+void
+timerstop(struct timer *t)
+{
+  struct timer *last;
+  int i = t->i;
+
+  if(i < 0)
+    return;
+  t->i = -1;
+  last = timers.heap[--timers.n];
+  if(last == t)
+    return;
+  put(i, last);
+  if(i > 0 && before(last->when, timers.heap[(i-1)/2]->when))
+    up(i);
+  else
+    down(i);
+}
+
+// Expire the timers that are due at the current tick.
+// Called by clockintr() with tickslock held.
+void
+timerexpire(void)
+{
+  struct timer *t;
+
+  while(timers.n > 0 && !before(ticks, timers.heap[0]->when)){
+    t = timers.heap[0];
+    timerstop(t);
+    wakeup(t);
+  }
+}
+
+// Set *when to the deadline of the timer that is due
+// first. Returns 0 if there are no timers.
+// Caller must hold tickslock.
+int
+timernext(uint *when)
+{
+  if(timers.n == 0)
+    return 0;
+  *when = timers.heap[0]->when;
+  return 1;
+}
+
+// Sleep for n ticks.
+// Returns 0, or -1 if the process was killed first.
+int
+ticksleep(int n)
+{
+  struct timer t;
+  int r = 0;
+
+  if(n <= 0)
+    return 0;
+  acquire(&tickslock);
+  timerstart(&t, ticks + n);
+  while(t.i >= 0){
+    if(killed(myproc())){
+      timerstop(&t);
+      r = -1;
+      break;
+    }
+    sleep(&t, &tickslock);
+  }
+  release(&tickslock);
+  return r;
+}
@@ -0,0 +1,6 @@
+// A one-shot timer, on which wakeup() is called when
+// the tick count reaches its deadline. See timer.c.
+struct timer {
+  uint when;         // Deadline, in ticks
+  int i;             // Index in the heap of pending timers, or -1
+};
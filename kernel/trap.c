@@ -11,6 +11,9 @@ uint ticks;
 
 extern char trampoline[], uservec[], userret[];
 
+// in usercopy.S.
+extern char usercopy[], usercopy_end[], usercopy_fault[];
+
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
@@ -45,6 +48,9 @@ usertrap(void)
   // since we're now in the kernel.
   w_stvec((uint64)kernelvec);
 
+  // kernel code touches user memory only inside usercopy.S.
+  w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+
   struct proc *p = myproc();
   
   // save user program counter.
@@ -65,6 +71,10 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p->pagetable, r_stval(), r_scause() == 15) == 0){
+    // page fault on a lazily allocated, not yet loaded,
+    // or copy-on-write page.
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -76,9 +86,9 @@ usertrap(void)
   if(killed(p))
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
+  // maybe give up the CPU if this is a timer interrupt.
   if(which_dev == 2)
-    yield();
+    preempt();
 
   usertrapret();
 }
@@ -91,6 +101,9 @@ usertrapret(void)
 {
   struct proc *p = myproc();
 
+  // a wakeup that got this far wasn't futile.
+  p->wokechan = 0;
+
   // we're about to switch the destination of traps from
   // kerneltrap() to usertrap(), so turn off interrupts until
   // we're back in user space, where usertrap() is correct.
@@ -102,7 +115,6 @@ usertrapret(void)
 
   // set up trapframe values that uservec will need when
   // the process next traps into the kernel.
-  p->trapframe->kernel_satp = r_satp();         // kernel page table
   p->trapframe->kernel_sp = p->kstack + PGSIZE; // process's kernel stack
   p->trapframe->kernel_trap = (uint64)usertrap;
   p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
@@ -114,19 +126,17 @@ usertrapret(void)
   unsigned long x = r_sstatus();
   x &= ~SSTATUS_SPP; // clear SPP to 0 for user mode
   x |= SSTATUS_SPIE; // enable interrupts in user mode
+  x &= ~SSTATUS_SUM; // no user memory access for the next trap
   w_sstatus(x);
 
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
-
   // jump to userret in trampoline.S at the top of memory, which 
-  // switches to the user page table, restores user registers,
-  // and switches to user mode with sret.
+  // restores user registers, and switches to user mode with sret.
+  // a clone() thread's trapframe is not at TRAPFRAME.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret)(satp);
+  ((void (*)(uint64))trampoline_userret)(p->tfva);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -144,17 +154,29 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  // a trap in copyin() or copyout() comes with SUM set.
+  // swtch() doesn't save sstatus, so clear it before
+  // vmfault() or preempt() can switch to another process;
+  // the w_sstatus() below sets it again for the copy.
+  w_sstatus(sstatus & ~SSTATUS_SUM);
+
+  if((scause == 13 || scause == 15) &&
+     sepc >= (uint64)usercopy && sepc < (uint64)usercopy_end){
+    // a page fault in copyin() or copyout()'s direct access
+    // to user memory: map the page and retry, or fail the copy.
+    if(vmfault(myproc()->pagetable, r_stval(), scause == 15) != 0)
+      sepc = (uint64)usercopy_fault;
+  } else if((which_dev = devintr()) == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
+  // maybe give up the CPU if this is a timer interrupt.
   if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
-    yield();
+    preempt();
 
-  // the yield() may have caused some traps to occur,
+  // the preempt() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
   w_sepc(sepc);
   w_sstatus(sstatus);
@@ -164,8 +186,10 @@ void
 clockintr()
 {
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  // count ticks from the time CSR, since an idle CPU
+  // may have slept through any number of them.
+  ticks = (r_time() - tickbase) / TICKCYCLES;
+  timerexpire();
   release(&tickslock);
 }
 
@@ -201,19 +225,26 @@ devintr()
       plic_complete(irq);
 
     return 1;
+  } else if(scause == 0x8000000000000005L){
+    // timer interrupt, forwarded by timervec in
+    // kernelvec.S. each CPU has its own timer.
+    clockintr();
+
+    // ask for another at the end of the next quantum,
+    // which also acknowledges this one.
+    mcall(MCALL_SETTIMER, r_time() + QUANTUM);
+
+    return 2;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from another CPU, to wake
+    // this one from wfi in idle(), or to flush its TLB.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
+    tlbpoll();
 
-    return 2;
+    return 1;
   } else {
     return 0;
   }
@@ -118,14 +118,11 @@ virtio_disk_init(void)
     panic("virtio disk max queue too short");
 
   // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
+  disk.desc = kalloc_zeroed();
+  disk.avail = kalloc_zeroed();
+  disk.used = kalloc_zeroed();
   if(!disk.desc || !disk.avail || !disk.used)
     panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
 
   // set queue size.
   *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
@@ -178,10 +175,10 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
 }
 
-// free a chain of descriptors.
+// free a chain of descriptors, and wake a process
+// waiting in virtio_disk_rw() to use them.
 static void
 free_chain(int i)
 {
@@ -194,6 +191,7 @@ free_chain(int i)
     else
       break;
   }
+  wakeup_one(&disk.free[0]);
 }
 
 // allocate three descriptors (they need not be contiguous).
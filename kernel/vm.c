@@ -3,26 +3,50 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
 
 /*
  * the kernel's page table.
  */
 pagetable_t kernel_pagetable;
 
+// a page of zeros, mapped read-only and copy-on-write
+// into untouched memory that a process reads.
+static char *zeropage;
+
+// Address space IDs. The kernel page table uses ASID 0.
+// Each process gets an ASID from the current generation
+// the next time it is scheduled, so switching page
+// tables needs no TLB flush. When the ASIDs run out
+// a new generation starts, and every CPU flushes its whole
+// TLB before it next runs a process with a new-generation
+// ASID. Without hardware ASIDs (max == 0) every process
+// uses ASID 0, and the TLB is flushed on every switch.
+struct {
+  struct spinlock lock;
+  uint64 gen;       // current generation, from 1
+  uint64 next;      // next unused ASID in this generation
+  uint64 max;       // largest ASID the hardware supports
+} asids;
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+extern struct proc proc[NPROC];
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -37,6 +61,7 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // mappages() uses megapages from the first 2MB boundary on.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -54,6 +79,8 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  if((zeropage = kalloc_zeroed()) == 0)
+    panic("kvminit: zeropage");
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -64,15 +91,222 @@ kvminithart()
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Find out how many ASID bits the hardware implements,
+// by writing all ones to satp's ASID field.
+// Called on hart 0 after kvminithart().
+void
+asidinit(void)
+{
+  initlock(&asids.lock, "asids");
+  w_satp(MAKE_SATP(kernel_pagetable, SATP_ASID_MASK));
+  asids.max = (r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
+  sfence_vma();
+  asids.gen = 1;
+  asids.next = 1;
+}
+
+// Switch this CPU to p's page table, which the kernel
+// runs on while p is scheduled. First give p an ASID if
+// it has none from the current generation, then flush
+// any TLB entries on this CPU that are stale for it.
+// Called by scheduler() and exec() with interrupts off.
+void
+uvmswitch(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  int bit = 1 << cpuid();
+
+  // the caller has set c->proc; pairs with the fence in
+  // tlbshoot(), so that either it sees p running here,
+  // or this sees its changes to p->tlbstale and the PTEs.
+  __sync_synchronize();
+
+  if(asids.max == 0){
+    w_satp(MAKE_SATP(p->pagetable, 0));
+    sfence_vma();
+    return;
+  }
+
+  if(p->asid_gen != __atomic_load_n(&asids.gen, __ATOMIC_ACQUIRE)){
+    acquire(&asids.lock);
+    if(asids.next > asids.max){
+      asids.gen++;
+      asids.next = 1;
+    }
+    p->asid = asids.next++;
+    p->asid_gen = asids.gen;
+    release(&asids.lock);
+    // no CPU has used this ASID since its generation began.
+    __sync_fetch_and_and(&p->tlbstale, 0);
+  }
+  // the kernel's mappings are the same in every page
+  // table, so stale entries for p's ASID can't affect
+  // the kernel before they are flushed.
+  w_satp(MAKE_SATP(p->pagetable, p->asid));
+  if(c->asid_gen != p->asid_gen){
+    // entries of older generations may use p's ASID.
+    sfence_vma();
+    c->asid_gen = p->asid_gen;
+  }
+  if(p->tlbstale & bit){
+    __sync_fetch_and_and(&p->tlbstale, ~bit);
+    sfence_vma_asid(p->asid);
+  }
+}
+
+// Switch this CPU back to the kernel's page table.
+// Called by scheduler() with interrupts off.
+void
+kvmswitch(void)
+{
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
+}
+
+// Share the kernel's mappings with a new user page table:
+// the level-1 tables for RAM and for the kernel stacks,
+// and the device entries of the low 1GB's level-1 table
+// from MAXUVA up. None of them have PTE_U set.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmkmap(pagetable_t pagetable)
+{
+  pagetable_t l1, kl1;
+
+  if((l1 = (pagetable_t)kalloc_zeroed()) == 0)
+    return -1;
+  kl1 = (pagetable_t)PTE2PA(kernel_pagetable[0]);
+  for(int i = PX(1, MAXUVA); i < 512; i++)
+    l1[i] = kl1[i];
+  pagetable[0] = PA2PTE(l1) | PTE_V;
+  pagetable[PX(2, KERNBASE)] = kernel_pagetable[PX(2, KERNBASE)];
+  pagetable[PX(2, KSTACKTOP-1)] = kernel_pagetable[PX(2, KSTACKTOP-1)];
+  return 0;
+}
+
+// Remove the kernel's mappings from a user page table
+// before freewalk(), so that the shared tables survive.
+void
+uvmkunmap(pagetable_t pagetable)
+{
+  pagetable_t l1;
+
+  l1 = (pagetable_t)PTE2PA(pagetable[0]);
+  for(int i = PX(1, MAXUVA); i < 512; i++)
+    l1[i] = 0;
+  pagetable[PX(2, KERNBASE)] = 0;
+  pagetable[PX(2, KSTACKTOP-1)] = 0;
+}
+
+// Flush this CPU's TLB if tlbshoot() has asked it to.
+// Called with interrupts off, from the software interrupt
+// that tlbshoot() sends, and while spinning for a lock.
+void
+tlbpoll(void)
+{
+  struct cpu *c = mycpu();
+  uint64 req = __atomic_load_n(&c->tlbreq, __ATOMIC_ACQUIRE);
+
+  if(req != c->tlbdone){
+    sfence_vma();
+    __atomic_store_n(&c->tlbdone, req, __ATOMIC_RELEASE);
+  }
+}
+
+// After a change to the page table that p shares with the
+// other threads of its group (see clone()), make sure none
+// of them goes on using a stale TLB entry. Each thread has
+// its own ASID: uvmswitch() flushes them when they next
+// run, and the CPUs running one now are interrupted to
+// flush their whole TLB, and waited for.
+// Called with interrupts off.
+static void
+tlbshoot(struct proc *p)
+{
+  struct proc *pp;
+  uint64 req[NCPU];
+  int i, me = cpuid();
+
+  for(pp = proc; pp < &proc[NPROC]; pp++)
+    if(pp != p && pp->tg == p->tg)
+      __sync_fetch_and_or(&pp->tlbstale, ~0);
+  __sync_synchronize();
+
+  for(i = 0; i < NCPU; i++){
+    req[i] = 0;
+    pp = cpus[i].proc;
+    if(i == me || pp == 0 || pp->tg != p->tg)
+      continue;
+    req[i] = __sync_add_and_fetch(&cpus[i].tlbreq, 1);
+    mcall(MCALL_IPI, i);
+  }
+  // a CPU we wait for may be spinning in tlbshoot() too.
+  for(i = 0; i < NCPU; i++)
+    while(__atomic_load_n(&cpus[i].tlbdone, __ATOMIC_ACQUIRE) < req[i])
+      tlbpoll();
+}
+
+// Flush the TLB entry for va after a change to its PTE
+// in pagetable. Only the current process's page table can
+// be in use by a TLB: the entry is flushed on this CPU
+// now, and on the other CPUs by uvmswitch() when the process
+// next runs there. Threads sharing the page table are left
+// to uvmshoot(). Page tables of other processes, and those
+// being built or torn down by exec() and exit(), hold no
+// live ASID.
+static void
+uvmflushva(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->pagetable != pagetable || p->asid_gen == 0)
+    return;
+  push_off();
+  if(asids.max == 0)
+    sfence_vma();
+  else if(va == -1)
+    sfence_vma_asid(p->asid);
+  else
+    sfence_vma_page(va, p->asid);
+  __sync_fetch_and_or(&p->tlbstale, ~(1 << cpuid()));
+  pop_off();
+}
+
+// Make the other live threads sharing pagetable drop their
+// TLB entries for it, once per change of any number of
+// PTEs. Exited threads never run again, so a process whose
+// other threads have all exited skips tlbshoot().
+static void
+uvmshoot(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->pagetable != pagetable || p->tg == 0 || p->tg->nlive == 1)
+    return;
+  push_off();
+  tlbshoot(p);
+  pop_off();
+}
+
+// Flush the TLB entries for va everywhere after a change
+// to its PTE in pagetable.
+static void
+uvmflush(pagetable_t pagetable, uint64 va)
+{
+  uvmflushva(pagetable, va);
+  uvmshoot(pagetable);
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
+// If va lies in a megapage, returns its level-1 leaf PTE.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -82,28 +316,40 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+// A valid PTE with R, W or X set at level 1 is a leaf
+// that maps a 2MB megapage, and has no level-0 table.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, alloc, 0);
+}
+
+// Like walk(), but return the PTE at the given level:
+// 0 for a page, 1 for a megapage. Stops early if it
+// finds a leaf above that level.
+pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(level, va)];
 }
 
-// Look up a virtual address, return the physical address,
-// or 0 if not mapped.
+// Look up a virtual address, return the physical address
+// of the page that contains it, or 0 if not mapped.
 // Can only be used to look up user pages.
 uint64
 walkaddr(pagetable_t pagetable, uint64 va)
@@ -114,9 +360,19 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, 1);
   if(pte == 0)
     return 0;
+  if((*pte & PTE_V) == 0)
+    return 0;
+  if(PTE_LEAF(*pte)){
+    // a megapage.
+    if((*pte & PTE_U) == 0)
+      return 0;
+    return PTE2PA(*pte) + (PGROUNDDOWN(va) & (MEGAPGSIZE - 1));
+  }
+
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(0, va)];
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
@@ -138,13 +394,16 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa.
 // va and size MUST be page-aligned.
+// Wherever va and pa are both 2MB-aligned and at least 2MB
+// remain, maps a whole megapage with one level-1 PTE.
 // Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, end, sz;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("mappages: va not aligned");
@@ -155,47 +414,132 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   if(size == 0)
     panic("mappages: size");
   
-  a = va;
-  last = va + size - PGSIZE;
-  for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+  end = va + size;
+  for(a = va; a != end; a += sz, pa += sz){
+    if(a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && end - a >= MEGAPGSIZE){
+      level = 1;
+      sz = MEGAPGSIZE;
+    } else {
+      level = 0;
+      sz = PGSIZE;
+    }
+    if((pte = walklevel(pagetable, a, 1, level)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
-      break;
-    a += PGSIZE;
-    pa += PGSIZE;
   }
   return 0;
 }
 
+#define UNMAPBATCH 32  // pages uvmunmap() frees per shootdown
+
+// Shoot down the TLB entries of the other threads sharing
+// pagetable after uvmunmap() has removed PTEs, then free
+// the n pages in pa[] that they mapped, which the threads
+// could reach until then. A set low bit marks a megapage.
+static void
+unmapfree(pagetable_t pagetable, uint64 *pa, int n)
+{
+  uvmshoot(pagetable);
+  for(int i = 0; i < n; i++){
+    if(pa[i] & 1)
+      kfree_mega((void*)(pa[i] & ~1L));
+    else
+      kfree((void*)pa[i]);
+  }
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
+// page-aligned. Pages that were never touched, and so
+// were never mapped, are skipped. A megapage must be
+// removed whole; see uvmsplit().
+// Optionally free the physical memory, UNMAPBATCH pages
+// at a time, with one TLB shootdown for each batch.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, start, end, freed[UNMAPBATCH];
   pte_t *pte;
+  int nfreed = 0, changed = 0;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
-    if(PTE_FLAGS(*pte) == PTE_V)
-      panic("uvmunmap: not a leaf");
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
+    pte = walklevel(pagetable, a, 0, 1);
+    if(pte == 0 || (*pte & PTE_V) == 0){
+      // nothing mapped in this 2MB.
+      a = (a | (MEGAPGSIZE - 1)) + 1 - PGSIZE;
+      continue;
+    }
+    start = a;
+    if(PTE_LEAF(*pte)){
+      if(a % MEGAPGSIZE != 0 || end - a < MEGAPGSIZE)
+        panic("uvmunmap: partial megapage");
+      if(do_free)
+        freed[nfreed++] = PTE2PA(*pte) | 1;
+      a += MEGAPGSIZE - PGSIZE;
+    } else {
+      pte = &((pagetable_t)PTE2PA(*pte))[PX(0, a)];
+      if((*pte & PTE_V) == 0)
+        continue;
+      if(PTE_FLAGS(*pte) == PTE_V)
+        panic("uvmunmap: not a leaf");
+      if(do_free)
+        freed[nfreed++] = PTE2PA(*pte);
     }
     *pte = 0;
+    uvmflushva(pagetable, start);
+    changed = 1;
+    if(nfreed == UNMAPBATCH){
+      unmapfree(pagetable, freed, nfreed);
+      nfreed = changed = 0;
+    }
   }
+  if(changed)
+    unmapfree(pagetable, freed, nfreed);
+}
+
+// Replace the megapage leaf PTE *pte by a level-0 table
+// that maps the same pages with the same flags.
+// Returns 0, or -1 if out of memory.
+static int
+split(pte_t *pte)
+{
+  pagetable_t pt;
+  uint64 pa;
+  uint flags;
+
+  if((pt = (pagetable_t)kalloc_zeroed()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte);
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
+// If va lies strictly inside a megapage, split it into
+// page mappings, so that the pages on either side of va
+// can be unmapped separately.
+// Returns 0, or -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if(va % MEGAPGSIZE == 0 || va >= MAXVA)
+    return 0;
+  pte = walklevel(pagetable, va, 0, 1);
+  if(pte == 0 || (*pte & PTE_V) == 0 || !PTE_LEAF(*pte))
+    return 0;
+  if(split(pte) != 0)
+    return -1;
+  uvmflush(pagetable, va);
+  return 0;
 }
 
 // create an empty user page table.
@@ -204,10 +548,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -221,8 +564,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -237,15 +579,16 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   if(newsz < oldsz)
     return oldsz;
+  if(newsz > MAXUVA)
+    return 0;
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -305,8 +648,11 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies only the page table: the child shares the
+// parent's physical pages, and writable pages become
+// read-only copy-on-write pages in both, to be copied
+// by vmfault() on the first write. Megapages are shared
+// whole.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
@@ -315,41 +661,380 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+    pte = walklevel(old, i, 0, 1);
+    if(pte == 0 || (*pte & PTE_V) == 0){
+      // nothing mapped in this 2MB.
+      i = (i | (MEGAPGSIZE - 1)) + 1 - PGSIZE;
+      continue;
+    }
+    if(PTE_LEAF(*pte)){
+      if(*pte & PTE_W)
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+      pa = PTE2PA(*pte);
+      flags = PTE_FLAGS(*pte);
+      if(mappages(new, i, MEGAPGSIZE, pa, flags) != 0)
+        goto err;
+      kref_mega((void*)pa);
+      i += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    pte = &((pagetable_t)PTE2PA(*pte))[PX(0, i)];
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;  // not touched yet
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    kref((void*)pa);
   }
+  // the parent's pages are no longer writable.
+  uvmflush(old, -1);
   return 0;
 
  err:
+  uvmflush(old, -1);
   uvmunmap(new, 0, i / PGSIZE, 1);
   return -1;
 }
 
-// mark a PTE invalid for user access.
-// used by exec for the user stack guard page.
-void
-uvmclear(pagetable_t pagetable, uint64 va)
+// End of the part of program segment v that vmaload()
+// maps. The zero-filled pages of a writable segment
+// are left to vmfault()'s code for heap pages.
+static uint64
+vmatop(struct vma *v)
+{
+  if(v->perm & PTE_W)
+    return PGROUNDUP(v->fileend);
+  return PGROUNDUP(v->end);
+}
+
+// The segment of p's program that vmaload() should
+// map the page at va from, or 0.
+static struct vma *
+vmafind(struct proc *p, uint64 va)
 {
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->ip && va >= v->start && va < vmatop(v))
+      return v;
+  return 0;
+}
+
+// Does any of [start, end) belong to p's stack, or the
+// guard gap below it?
+static int
+stackoverlap(struct proc *p, uint64 start, uint64 end)
+{
+  return p->stackbase - USTACKGUARD < end && p->stacktop > start;
+}
+
+// Does any of [start, end) belong to vmaload()?
+static int
+vmaoverlap(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->ip && v->start < end && vmatop(v) > start)
+      return 1;
+  return 0;
+}
+
+// Map the page at va of program segment v, reading it
+// in from the executable. Pages of read-only segments
+// are shared through the text cache. Reading may sleep,
+// so this fails if the caller holds a spinlock; it also
+// fails rather than lock the executable if the caller
+// holds some other sleeplock, which could deadlock
+// against a process faulting the other way round. See
+// vmprefault().
+static int
+vmaload(pagetable_t pagetable, struct vma *v, uint64 va)
+{
+  struct proc *p = myproc();
+  struct inode *ip = v->ip;
+  uint off = v->off + (va - v->start);
+  int shared = (v->perm & PTE_W) == 0;
+  char *mem;
   pte_t *pte;
-  
+  int n = 0, r = 0, locked;
+
+  if(holdingany())
+    return -1;
+  if(va < v->fileend)
+    n = v->fileend - va < PGSIZE ? v->fileend - va : PGSIZE;
+  if(shared && n > 0 && (mem = textget(ip, off, n)) != 0)
+    goto map;
+
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(n > 0){
+    // the fault may be in copyout() for a read() of the
+    // executable itself, which holds its lock.
+    locked = holdingsleep(&ip->lock);
+    if(p->nsleeplock > locked){
+      kfree(mem);
+      return -1;
+    }
+    if(!locked)
+      ilock(ip);
+    r = readi(ip, 0, (uint64)mem, off, n);
+    // writei() evicts under the inode lock too, so
+    // stale contents can't get into the cache.
+    if(r == n && shared)
+      mem = textput(ip, off, n, mem);
+    if(!locked)
+      iunlock(ip);
+  }
+  if(r != n){
+    kfree(mem);
+    return -1;
+  }
+
+ map:
+  // someone may have mapped it while we slept.
+  tglock(p);
   pte = walk(pagetable, va, 0);
-  if(pte == 0)
-    panic("uvmclear");
-  *pte &= ~PTE_U;
+  if(pte && (*pte & PTE_V)){
+    tgunlock(p);
+    kfree(mem);
+    return 0;
+  }
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, v->perm) != 0){
+    tgunlock(p);
+    kfree(mem);
+    return -1;
+  }
+  uvmflush(pagetable, va);
+  tgunlock(p);
+  return 0;
+}
+
+// Can the aligned 2MB at base be a megapage of p's? It
+// must be all below p->sz, and hold no part of a program
+// segment that vmaload() maps, nor of the stack.
+static int
+megaok(struct proc *p, uint64 base)
+{
+  return base + MEGAPGSIZE <= p->sz && !vmaoverlap(p, base, base + MEGAPGSIZE) &&
+         !stackoverlap(p, base, base + MEGAPGSIZE);
+}
+
+// Does level-0 table pt map nothing but the zero page,
+// as reads of untouched memory leave it?
+static int
+zeroonly(pagetable_t pt)
+{
+  for(int i = 0; i < 512; i++)
+    if((pt[i] & PTE_V) && PTE2PA(pt[i]) != (uint64)zeropage)
+      return 0;
+  return 1;
+}
+
+// Does the valid leaf PTE pte already allow the access?
+// Then another thread sharing the page table mapped the
+// page while this one waited for the lock, and the
+// access should just be retried.
+static int
+allowed(pte_t pte, int write)
+{
+  return (pte & PTE_U) && (pte & (write ? PTE_W : PTE_R));
+}
+
+// The work of vmfault(), with the thread group locked.
+// Sets *vp instead of calling vmaload().
+static int
+fault(pagetable_t pagetable, uint64 va, int write, struct vma **vp)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pagetable_t pt;
+  pte_t *pte;
+  uint64 pa, base;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXUVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  base = va & ~(MEGAPGSIZE - 1);
+
+  pte = walklevel(pagetable, va, 0, 1);
+  if(pte && (*pte & PTE_V) && PTE_LEAF(*pte)){
+    if(allowed(*pte, write))
+      return 0;
+    if((*pte & PTE_U) == 0 || !write || (*pte & PTE_COW) == 0)
+      return -1;
+    if(split(pte) != 0)
+      return -1;
+    uvmflush(pagetable, va);
+  } else if(pte == 0 || (*pte & PTE_V) == 0){
+    if(p == 0 || pagetable != p->pagetable || va >= p->sz)
+      return -1;
+    // a read maps the zero page below; the megapage
+    // waits for the first write.
+    if(write && megaok(p, base) && (mem = kalloc_mega()) != 0){
+      if(mappages(pagetable, base, MEGAPGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+        kfree_mega(mem);
+        return -1;
+      }
+      uvmflush(pagetable, base);
+      return 0;
+    }
+  } else if(write && p != 0 && pagetable == p->pagetable &&
+            megaok(p, base) &&
+            zeroonly(pt = (pagetable_t)PTE2PA(*pte)) && (mem = kalloc_mega()) != 0){
+    // the first write to a 2MB that has only been read:
+    // replace its zero page mappings by a megapage.
+    *pte = PA2PTE(mem) | PTE_R | PTE_W | PTE_U | PTE_V;
+    uvmflush(pagetable, -1);
+    for(int i = 0; i < 512; i++)
+      if(pt[i] & PTE_V)
+        kfree(zeropage);
+    kfree(pt);
+    return 0;
+  }
+
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    if(p == 0 || pagetable != p->pagetable || va >= p->sz)
+      return -1;
+    if(va >= p->stackbase - USTACKGUARD && va < p->stackbase)
+      return -1;
+    if((v = vmafind(p, va)) != 0){
+      *vp = v;
+      return 0;
+    }
+    if(!write){
+      if(mappages(pagetable, va, PGSIZE, (uint64)zeropage, PTE_R|PTE_U|PTE_COW) != 0)
+        return -1;
+      kref(zeropage);
+      uvmflush(pagetable, va);
+      return 0;
+    }
+    if((mem = kalloc_zeroed()) == 0)
+      return -1;
+    if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+      kfree(mem);
+      return -1;
+    }
+    uvmflush(pagetable, va);
+    return 0;
+  }
+  if(allowed(*pte, write))
+    return 0;
+  if((*pte & PTE_U) == 0)
+    return -1;
+  if(!write || (*pte & PTE_COW) == 0)
+    return -1;
+
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  if(pa == (uint64)zeropage){
+    if((mem = kalloc_zeroed()) == 0)
+      return -1;
+  } else if(krefcnt((void*)pa) == 1){
+    // the other sharers have gone.
+    *pte = PA2PTE(pa) | flags;
+    uvmflush(pagetable, va);
+    return 0;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, (char*)pa, PGSIZE);
+  }
+  *pte = PA2PTE(mem) | flags;
+  uvmflush(pagetable, va);
+  kfree((void*)pa);
+  return 0;
+}
+
+// Handle a page fault at user virtual address va in
+// pagetable; write is non-zero for a store.
+// The first touch of a page of the program's text or
+// data reads it in from the executable, since exec()
+// reads nothing; this may sleep.
+// The first touch of any other page below the current
+// process's size maps a zeroed page: sbrk() only moves p->sz,
+// and exec() maps only the top page of the stack. A read
+// maps the shared zero page copy-on-write instead, so that
+// memory that is only read costs nothing. If a write finds
+// the aligned 2MB around va all heap or bss, and none of it
+// touched yet or only read, it is backed by a megapage
+// instead, unless no 2MB of contiguous memory is free.
+// The guard gap below the stack is never mapped, so a
+// stack that outgrows its limit faults.
+// A write to a copy-on-write page gets a private copy
+// of the page, or just write access if no other page
+// table still shares it. A copy-on-write megapage is
+// first split into pages.
+// Returns 0 if the fault was handled and the access
+// should be retried, -1 if it was a real fault.
+int
+vmfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v = 0;
+  int r;
+
+  // threads sharing pagetable may fault on the same page,
+  // or change p->sz. vmaload() may sleep, so it runs
+  // without the lock, and takes it only to map the page.
+  if(p)
+    tglock(p);
+  r = fault(pagetable, va, write, &v);
+  if(p)
+    tgunlock(p);
+  if(r == 0 && v)
+    r = vmaload(pagetable, v, PGROUNDDOWN(va));
+  return r;
+}
+
+// Read in any not yet loaded program pages of [va, va+len),
+// for a caller about to copy to or from them while holding
+// a spinlock, when vmfault() can't sleep to read the file,
+// or a sleeplock, when it won't.
+void
+vmprefault(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  uint64 a, end;
+
+  if(pagetable != p->pagetable || va >= p->sz)
+    return;
+  if(len > p->sz - va)
+    len = p->sz - va;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->ip == 0)
+      continue;
+    a = PGROUNDDOWN(va) > v->start ? PGROUNDDOWN(va) : v->start;
+    end = va + len < vmatop(v) ? va + len : vmatop(v);
+    for(; a < end; a += PGSIZE){
+      pte = walk(pagetable, a, 0);
+      if(pte == 0 || (*pte & PTE_V) == 0)
+        vmaload(pagetable, v, a);
+    }
+  }
+}
+
+// Is pagetable the one this CPU is running on? If so,
+// copyin() and friends access user memory directly, with
+// sstatus.SUM set, rather than by walking the page table.
+// A fault there is resolved by kerneltrap() calling
+// vmfault(), or makes the copy return -1.
+static int
+uvmcurrent(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  return p != 0 && p->pagetable == pagetable;
 }
 
 // Copy from kernel to user.
@@ -361,15 +1046,22 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   uint64 n, va0, pa0;
   pte_t *pte;
 
+  if(dstva >= MAXUVA || len > MAXUVA - dstva)
+    return -1;
+  if(uvmcurrent(pagetable))
+    return copy_user((void *)dstva, src, len);
+
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    if(va0 >= MAXVA)
-      return -1;
     pte = walk(pagetable, va0, 0);
-    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
-       (*pte & PTE_W) == 0)
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_W) == 0){
+      if(vmfault(pagetable, va0, 1) != 0)
+        return -1;
+      pte = walk(pagetable, va0, 0);
+    }
+    if((*pte & PTE_U) == 0)
       return -1;
-    pa0 = PTE2PA(*pte);
+    pa0 = walkaddr(pagetable, va0);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -390,11 +1082,19 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(srcva >= MAXUVA || len > MAXUVA - srcva)
+    return -1;
+  if(uvmcurrent(pagetable))
+    return copy_user(dst, (void *)srcva, len);
+
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      if(vmfault(pagetable, va0, 0) != 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
@@ -417,11 +1117,21 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   uint64 n, va0, pa0;
   int got_null = 0;
 
+  if(srcva >= MAXUVA)
+    return -1;
+  if(max > MAXUVA - srcva)
+    max = MAXUVA - srcva;
+  if(uvmcurrent(pagetable))
+    return copy_user_str(dst, (char *)srcva, max);
+
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      if(vmfault(pagetable, va0, 0) != 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
@@ -0,0 +1,65 @@
+// Measure how page allocation scales across harts.
+// For 1..maxprocs concurrent processes, each process
+// repeatedly grows and shrinks its heap, so every round
+// is a burst of kalloc()s followed by a burst of kfree()s.
+// The work per process is fixed, so with no allocator
+// contention the elapsed time stays flat as processes
+// (up to the number of harts) are added.
+//
+// usage: kallocbench [maxprocs]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NPAGES  64    // pages per sbrk burst
+#define ROUNDS  200   // bursts per process
+
+void
+churn(void)
+{
+  for(int i = 0; i < ROUNDS; i++){
+    char *a = sbrk(NPAGES * 4096);
+    if(a == (char*)-1){
+      printf("kallocbench: sbrk failed\n");
+      exit(1);
+    }
+    // make sure the pages are really there.
+    for(int j = 0; j < NPAGES; j++)
+      a[j * 4096] = j;
+    sbrk(-(NPAGES * 4096));
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxprocs = 8;
+
+  if(argc > 1)
+    maxprocs = atoi(argv[1]);
+  if(maxprocs < 1){
+    fprintf(2, "usage: kallocbench [maxprocs]\n");
+    exit(1);
+  }
+
+  printf("kallocbench: %d pages x %d rounds per process\n", NPAGES, ROUNDS);
+  for(int n = 1; n <= maxprocs; n++){
+    int t0 = uptime();
+    for(int i = 0; i < n; i++){
+      int pid = fork();
+      if(pid < 0){
+        printf("kallocbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0){
+        churn();
+        exit(0);
+      }
+    }
+    for(int i = 0; i < n; i++)
+      wait(0);
+    printf("%d procs: %d ticks\n", n, uptime() - t0);
+  }
+  exit(0);
+}
@@ -0,0 +1,59 @@
+// Measure the cost of a sleep() and wakeup() round trip:
+// two processes bounce a byte back and forth over a pair
+// of pipes, so every read() sleeps until the other side
+// writes.
+//
+// usage: pipebench [round trips]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  int ping[2], pong[2], pid, n = 10000, i, t0, t1;
+  char c = 0;
+
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n < 1){
+    fprintf(2, "usage: pipebench [round trips]\n");
+    exit(1);
+  }
+
+  if(pipe(ping) < 0 || pipe(pong) < 0){
+    printf("pipebench: pipe failed\n");
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("pipebench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(ping[1]);
+    close(pong[0]);
+    for(i = 0; i < n; i++){
+      if(read(ping[0], &c, 1) != 1 || write(pong[1], &c, 1) != 1){
+        printf("pipebench: child failed\n");
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  close(ping[0]);
+  close(pong[1]);
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    if(write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1){
+      printf("pipebench: parent failed\n");
+      exit(1);
+    }
+  }
+  t1 = uptime();
+  wait(0);
+  printf("pipe ping-pong: %d round trips in %d ticks\n", n, t1 - t0);
+  exit(0);
+}
@@ -0,0 +1,100 @@
+// Measure the cost of large read() and write() calls,
+// which spend most of their time in copyin() and
+// copyout(). Moves data through a pipe between two
+// processes, and re-reads a small file that stays in
+// the buffer cache.
+//
+// usage: rwbench [megabytes]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define BUFSZ   (64*1024)   // bytes per read() or write()
+#define FILESZ  (10*1024)   // fits in the direct blocks
+
+static char buf[BUFSZ];
+
+void
+pipetest(int mb)
+{
+  int fds[2], pid, n, t0;
+  long total = (long)mb * 1024 * 1024, left;
+
+  if(pipe(fds) < 0){
+    printf("rwbench: pipe failed\n");
+    exit(1);
+  }
+  t0 = uptime();
+  pid = fork();
+  if(pid < 0){
+    printf("rwbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    for(left = total; left > 0; left -= n){
+      n = left < BUFSZ ? left : BUFSZ;
+      if(write(fds[1], buf, n) != n){
+        printf("rwbench: pipe write failed\n");
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  close(fds[1]);
+  for(left = total; left > 0; left -= n){
+    if((n = read(fds[0], buf, BUFSZ)) <= 0){
+      printf("rwbench: pipe read failed\n");
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  wait(0);
+  printf("pipe: %d MB in %d ticks\n", mb, uptime() - t0);
+}
+
+void
+filetest(int mb)
+{
+  int fd, i, rounds, t0;
+
+  fd = open("rwbench.tmp", O_CREATE | O_RDWR);
+  if(fd < 0 || write(fd, buf, FILESZ) != FILESZ){
+    printf("rwbench: create failed\n");
+    exit(1);
+  }
+  close(fd);
+
+  rounds = (mb * 1024) / (FILESZ / 1024);
+  t0 = uptime();
+  for(i = 0; i < rounds; i++){
+    if((fd = open("rwbench.tmp", O_RDONLY)) < 0 ||
+       read(fd, buf, BUFSZ) != FILESZ){
+      printf("rwbench: read failed\n");
+      exit(1);
+    }
+    close(fd);
+  }
+  printf("file: %d MB in %d ticks\n", mb, uptime() - t0);
+  unlink("rwbench.tmp");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int mb = 16;
+
+  if(argc > 1)
+    mb = atoi(argv[1]);
+  if(mb < 1){
+    fprintf(2, "usage: rwbench [megabytes]\n");
+    exit(1);
+  }
+
+  memset(buf, 'x', sizeof(buf));
+  pipetest(mb);
+  filetest(mb);
+  exit(0);
+}
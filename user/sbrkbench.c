@@ -0,0 +1,79 @@
+// Measure sbrk() and fork() throughput, which are
+// dominated by allocating and zeroing or copying pages.
+// Run it on kernels built with and without KALLOC_DEBUG
+// to see the cost of filling pages with junk.
+//
+// usage: sbrkbench [rounds]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NPAGES  256   // pages per sbrk burst
+#define NFORK   32    // forks per round
+
+void
+sbrkrounds(int rounds)
+{
+  for(int i = 0; i < rounds; i++){
+    char *a = sbrk(NPAGES * 4096);
+    if(a == (char*)-1){
+      printf("sbrkbench: sbrk failed\n");
+      exit(1);
+    }
+    for(int j = 0; j < NPAGES; j++)
+      a[j * 4096] = j;
+    sbrk(-(NPAGES * 4096));
+  }
+}
+
+void
+forkrounds(int rounds)
+{
+  // give the children some memory to copy.
+  char *a = sbrk(NPAGES * 4096);
+  if(a == (char*)-1){
+    printf("sbrkbench: sbrk failed\n");
+    exit(1);
+  }
+  for(int j = 0; j < NPAGES; j++)
+    a[j * 4096] = j;
+
+  for(int i = 0; i < rounds; i++){
+    for(int j = 0; j < NFORK; j++){
+      int pid = fork();
+      if(pid < 0){
+        printf("sbrkbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        exit(0);
+      wait(0);
+    }
+  }
+  sbrk(-(NPAGES * 4096));
+}
+
+int
+main(int argc, char *argv[])
+{
+  int rounds = 20;
+  int t0;
+
+  if(argc > 1)
+    rounds = atoi(argv[1]);
+  if(rounds < 1){
+    fprintf(2, "usage: sbrkbench [rounds]\n");
+    exit(1);
+  }
+
+  t0 = uptime();
+  sbrkrounds(rounds);
+  printf("sbrk: %d x %d pages: %d ticks\n", rounds, NPAGES, uptime() - t0);
+
+  t0 = uptime();
+  forkrounds(rounds);
+  printf("fork: %d x %d forks of %d pages: %d ticks\n",
+         rounds, NFORK, NPAGES, uptime() - t0);
+  exit(0);
+}
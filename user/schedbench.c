@@ -0,0 +1,90 @@
+// Measure how quickly an interactive process gets the CPU
+// while CPU-bound processes compete for it: a process that
+// sleeps a tick between short pipe round trips with an
+// echo process, and a number of processes that only
+// compute. Prints the round trip times and the priority
+// levels the scheduler has given each kind of process.
+//
+// usage: schedbench [cpu-bound processes] [round trips]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define MAXJOBS 16
+
+int
+main(int argc, char *argv[])
+{
+  int ping[2], pong[2], pids[MAXJOBS], echo, njobs = 4, n = 20, i;
+  uint64 t, total = 0, worst = 0;
+  volatile int spin = 0;
+  char c = 0;
+
+  if(argc > 1)
+    njobs = atoi(argv[1]);
+  if(argc > 2)
+    n = atoi(argv[2]);
+  if(njobs < 0 || njobs > MAXJOBS || n < 1){
+    fprintf(2, "usage: schedbench [cpu-bound processes] [round trips]\n");
+    exit(1);
+  }
+
+  for(i = 0; i < njobs; i++){
+    if((pids[i] = fork()) < 0){
+      printf("schedbench: fork failed\n");
+      exit(1);
+    }
+    if(pids[i] == 0){
+      for(;;)
+        spin++;
+    }
+  }
+
+  if(pipe(ping) < 0 || pipe(pong) < 0){
+    printf("schedbench: pipe failed\n");
+    exit(1);
+  }
+  if((echo = fork()) < 0){
+    printf("schedbench: fork failed\n");
+    exit(1);
+  }
+  if(echo == 0){
+    close(ping[1]);
+    close(pong[0]);
+    while(read(ping[0], &c, 1) == 1)
+      if(write(pong[1], &c, 1) != 1)
+        break;
+    exit(0);
+  }
+  close(ping[0]);
+  close(pong[1]);
+
+  for(i = 0; i < n; i++){
+    sleep(1);
+    t = utime();
+    if(write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1){
+      printf("schedbench: round trip failed\n");
+      exit(1);
+    }
+    t = utime() - t;
+    total += t;
+    if(t > worst)
+      worst = t;
+  }
+
+  printf("%d cpu-bound: round trip average %d, worst %d time cycles\n",
+         njobs, (int)(total / n), (int)worst);
+  printf("levels: interactive %d, echo %d", getlevel(getpid()), getlevel(echo));
+  if(njobs > 0)
+    printf(", cpu-bound %d", getlevel(pids[0]));
+  printf("\n");
+
+  close(ping[1]);
+  wait(0);
+  for(i = 0; i < njobs; i++){
+    kill(pids[i]);
+    wait(0);
+  }
+  exit(0);
+}
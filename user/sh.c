@@ -3,6 +3,7 @@
 #include "kernel/types.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
+#include "kernel/spawn.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -12,6 +13,7 @@
 #define BACK  5
 
 #define MAXARGS 10
+#define MAXSTAGES 8  // commands in a pipeline run by spawncmd()
 
 struct cmd {
   int type;
@@ -52,6 +54,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
 void runcmd(struct cmd*) __attribute__((noreturn));
 
 // Execute cmd.  Never returns.
@@ -131,6 +134,117 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// Return the command at the bottom of cmd's
+// redirections, or 0 if that is not a program to run.
+struct execcmd*
+simplecmd(struct cmd *cmd)
+{
+  while(cmd->type == REDIR)
+    cmd = ((struct redircmd*)cmd)->cmd;
+  if(cmd->type != EXEC || ((struct execcmd*)cmd)->argv[0] == 0)
+    return 0;
+  return (struct execcmd*)cmd;
+}
+
+void
+setact(struct spawnact *a, int op, int fd, int newfd)
+{
+  memset(a, 0, sizeof(*a));
+  a->op = op;
+  a->fd = fd;
+  a->newfd = newfd;
+}
+
+// Append the spawn() actions for cmd's redirections to
+// act[0..n-1], outermost first, the order in which
+// runcmd() would open the files. Returns the new number
+// of actions, or -1 if there are too many.
+int
+rediracts(struct cmd *cmd, struct spawnact *act, int n)
+{
+  struct redircmd *rcmd;
+
+  for(; cmd->type == REDIR; cmd = rcmd->cmd){
+    rcmd = (struct redircmd*)cmd;
+    if(n >= MAXSPAWNACT-1)
+      return -1;
+    setact(&act[n], SPAWN_OPEN, 0, rcmd->fd);
+    act[n].mode = rcmd->mode;
+    act[n].path = rcmd->file;
+    n++;
+  }
+  return n;
+}
+
+// Run cmd with spawn() if it is a simple command or a
+// pipeline of them, and wait for it. That costs less than
+// fork() and exec(), since none of the shell's memory is
+// copied. Returns -1, having run nothing, for any other
+// command.
+int
+spawncmd(struct cmd *cmd)
+{
+  struct cmd *stage[MAXSTAGES];
+  struct spawnact act[MAXSPAWNACT];
+  struct execcmd *ecmd;
+  int i, n, nstage, nproc, in, p[2];
+
+  // the parser nests a pipeline to the right.
+  nstage = 0;
+  while(cmd->type == PIPE){
+    if(nstage >= MAXSTAGES-1)
+      return -1;
+    stage[nstage++] = ((struct pipecmd*)cmd)->left;
+    cmd = ((struct pipecmd*)cmd)->right;
+  }
+  stage[nstage++] = cmd;
+
+  // a stage reading from a pipe needs 2 actions to set up
+  // fd 0, and one writing to a pipe 3 for fd 1.
+  for(i = 0; i < nstage; i++){
+    n = (i > 0 ? 2 : 0) + (i < nstage-1 ? 3 : 0);
+    if(simplecmd(stage[i]) == 0 || rediracts(stage[i], act, n) < 0)
+      return -1;
+  }
+
+  in = -1;
+  nproc = 0;
+  for(i = 0; i < nstage; i++){
+    n = 0;
+    if(i < nstage-1 && pipe(p) < 0)
+      panic("pipe");
+    if(in >= 0)
+      setact(&act[n++], SPAWN_DUP2, in, 0);
+    if(i < nstage-1)
+      setact(&act[n++], SPAWN_DUP2, p[1], 1);
+    if(in >= 0)
+      setact(&act[n++], SPAWN_CLOSE, in, 0);
+    if(i < nstage-1){
+      setact(&act[n++], SPAWN_CLOSE, p[0], 0);
+      setact(&act[n++], SPAWN_CLOSE, p[1], 0);
+    }
+    n = rediracts(stage[i], act, n);
+    setact(&act[n], 0, 0, 0);
+
+    ecmd = simplecmd(stage[i]);
+    if(spawn(ecmd->argv[0], ecmd->argv, act) < 0)
+      fprintf(2, "spawn %s failed\n", ecmd->argv[0]);
+    else
+      nproc++;
+
+    if(in >= 0)
+      close(in);
+    if(i < nstage-1){
+      close(p[1]);
+      in = p[0];
+    }
+  }
+
+  while(nproc-- > 0)
+    wait(0);
+  return 0;
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -146,6 +260,7 @@ int
 main(void)
 {
   static char buf[100];
+  struct cmd *cmd;
   int fd;
 
   // Ensure that three file descriptors are open.
@@ -165,9 +280,14 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
-    if(fork1() == 0)
-      runcmd(parsecmd(buf));
-    wait(0);
+    if((cmd = parsecmd(buf)) == 0)
+      continue;
+    if(spawncmd(cmd) < 0){
+      if(fork1() == 0)
+        runcmd(cmd);
+      wait(0);
+    }
+    freecmd(cmd);
   }
   exit(0);
 }
@@ -325,18 +445,37 @@ struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
 struct cmd *nulterminate(struct cmd*);
 
+int parseerr;
+
+// Report a syntax error. The shell parses each command
+// itself, so it can't just exit; instead parsecmd()
+// discards the command.
+void
+syntax(char *msg)
+{
+  if(!parseerr)
+    fprintf(2, "%s\n", msg);
+  parseerr = 1;
+}
+
+// Parse s, or return 0 if it has a syntax error.
 struct cmd*
 parsecmd(char *s)
 {
   char *es;
   struct cmd *cmd;
 
+  parseerr = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && !parseerr){
     fprintf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if(parseerr){
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -380,8 +519,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      continue;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -407,8 +548,9 @@ parseblock(char **ps, char *es)
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
   if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
-  gettoken(ps, es, 0, 0);
+    syntax("syntax - missing )");
+  else
+    gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
 }
@@ -432,13 +574,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
+    if(argc >= MAXARGS-1){
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -492,3 +638,40 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+void
+freecmd(struct cmd *cmd)
+{
+  struct backcmd *bcmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    freecmd(rcmd->cmd);
+    break;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+    break;
+
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    freecmd(lcmd->left);
+    freecmd(lcmd->right);
+    break;
+
+  case BACK:
+    bcmd = (struct backcmd*)cmd;
+    freecmd(bcmd->cmd);
+    break;
+  }
+  free(cmd);
+}
@@ -0,0 +1,85 @@
+// Measure the benefit of megapage (2MB) heap mappings.
+// Strides over a large sbrk'd array twice: once after
+// growing the heap in one big step, which lets the kernel
+// back each aligned 2MB with a megapage, and once after
+// growing it a page at a time, touching each page as it
+// goes, which forces 4KB mappings. The stride is one page,
+// so every access in the second case needs its own TLB entry.
+//
+// usage: thpbench [megabytes]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define PASSES 20
+
+int
+stride(char *a, int n)
+{
+  int sum = 0;
+
+  for(int pass = 0; pass < PASSES; pass++)
+    for(int i = 0; i < n; i += 4096)
+      sum += a[i]++;
+  return sum;
+}
+
+char *
+bigstep(int n)
+{
+  char *a = sbrk(n);
+  if(a == (char*)-1){
+    printf("thpbench: sbrk failed\n");
+    exit(1);
+  }
+  return a;
+}
+
+char *
+smallsteps(int n)
+{
+  char *a = sbrk(0);
+  for(int i = 0; i < n; i += 4096){
+    char *p = sbrk(4096);
+    if(p == (char*)-1){
+      printf("thpbench: sbrk failed\n");
+      exit(1);
+    }
+    *p = 0;
+  }
+  return a;
+}
+
+void
+run(char *name, char *(*grow)(int), int n)
+{
+  char *top = sbrk(0);
+  int t0, t1, sum;
+
+  t0 = uptime();
+  char *a = grow(n);
+  t1 = uptime();
+  sum = stride(a, n);
+  printf("%s: grow %d ticks, %d passes %d ticks (%d)\n",
+         name, t1 - t0, PASSES, uptime() - t1, sum);
+  sbrk(top - (char*)sbrk(0));
+}
+
+int
+main(int argc, char *argv[])
+{
+  int mb = 32;
+
+  if(argc > 1)
+    mb = atoi(argv[1]);
+  if(mb < 1){
+    fprintf(2, "usage: thpbench [megabytes]\n");
+    exit(1);
+  }
+
+  printf("thpbench: %d MB array, %d passes\n", mb, PASSES);
+  run("megapages", bigstep, mb * 1024 * 1024);
+  run("4KB pages", smallsteps, mb * 1024 * 1024);
+  exit(0);
+}
@@ -0,0 +1,85 @@
+// Measure how well threads made by clone() spread work
+// over the CPUs: sums an array in shared memory with 1,
+// 2, 4 and 8 threads, each taking an equal part of it,
+// and prints the time each sum takes.
+//
+// usage: threadbench [megabytes]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define MAXTHREAD 8
+#define STACKSZ   4096
+
+int *a;
+uint64 n;
+int nthread;
+uint64 part[MAXTHREAD];
+
+void
+sum(void *arg)
+{
+  int id = (int)(uint64)arg;
+  uint64 i, s = 0;
+
+  for(i = n * id / nthread; i < n * (id+1) / nthread; i++)
+    s += a[i];
+  part[id] = s;
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int mb = 8, i;
+  uint64 t, total, want = 0;
+  char *stacks;
+
+  if(argc > 1)
+    mb = atoi(argv[1]);
+  if(mb < 1){
+    fprintf(2, "usage: threadbench [megabytes]\n");
+    exit(1);
+  }
+
+  n = (uint64)mb * 1024 * 1024 / sizeof(int);
+  a = (int*)sbrk(n * sizeof(int));
+  stacks = sbrk(MAXTHREAD * STACKSZ);
+  if((char*)a == (char*)-1 || stacks == (char*)-1){
+    printf("threadbench: sbrk failed\n");
+    exit(1);
+  }
+  // fault in the array before timing.
+  for(i = 0; i < n; i++){
+    a[i] = i;
+    want += i;
+  }
+
+  for(nthread = 1; nthread <= MAXTHREAD; nthread *= 2){
+    t = utime();
+    for(i = 0; i < nthread; i++){
+      if(clone(sum, stacks + (i+1)*STACKSZ, (void*)(uint64)i) < 0){
+        printf("threadbench: clone failed\n");
+        exit(1);
+      }
+    }
+    for(i = 0; i < nthread; i++){
+      if(join() < 0){
+        printf("threadbench: join failed\n");
+        exit(1);
+      }
+    }
+    t = utime() - t;
+
+    total = 0;
+    for(i = 0; i < nthread; i++)
+      total += part[i];
+    if(total != want){
+      printf("threadbench: wrong sum with %d threads\n", nthread);
+      exit(1);
+    }
+    printf("%d threads: %d time cycles\n", nthread, (int)t);
+  }
+  exit(0);
+}
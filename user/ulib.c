@@ -1,6 +1,8 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "kernel/memlayout.h"
 #include "user/user.h"
 
 //
@@ -145,3 +147,30 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+// getpid() without a system call, from the usyscall page.
+int
+ugetpid(void)
+{
+  struct usyscall *u = (struct usyscall *)USYSCALL;
+  return u->pid;
+}
+
+// the time CSR: a clock that counts up at a fixed rate
+// since boot, read without a system call.
+uint64
+utime(void)
+{
+  uint64 x;
+  asm volatile("rdtime %0" : "=r" (x));
+  return x;
+}
+
+// uptime() without a system call: the number of clock
+// ticks since boot, computed from the time CSR.
+int
+uuptime(void)
+{
+  struct usyscall *u = (struct usyscall *)USYSCALL;
+  return (utime() - u->tickbase) / u->tickcycles;
+}
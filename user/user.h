@@ -1,7 +1,9 @@
 struct stat;
+struct spawnact;
 
 // system calls
 int fork(void);
+int vfork(void);
 int exit(int) __attribute__((noreturn));
 int wait(int*);
 int pipe(int*);
@@ -22,6 +24,12 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int stacklimit(int);
+int getlevel(int);
+int setweight(int, int);
+int clone(void (*)(void*), void*, void*);
+int join(void);
+int spawn(const char*, char**, struct spawnact*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -39,3 +47,6 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+int ugetpid(void);
+int uuptime(void);
+uint64 utime(void);
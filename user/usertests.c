@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/spawn.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -2395,20 +2396,45 @@ void argptest(char *s)
   close(fd);
 }
 
-// check that there's an invalid page beneath
-// the user stack, to catch stack overflow.
+// recurse n deep, with a 1KB stack frame.
+int
+stackdeep(int n)
+{
+  volatile char buf[1024];
+
+  buf[0] = buf[sizeof(buf)-1] = n;
+  if(n == 0)
+    return 0;
+  return stackdeep(n - 1) + buf[0] - buf[sizeof(buf)-1];
+}
+
+// check that the user stack grows on demand to its
+// limit, and that a stack that overflows the limit
+// faults in the guard gap beneath it.
 void
 stacktest(char *s)
 {
   int pid;
   int xstatus;
-  
+
+  pid = fork();
+  if(pid == 0) {
+    exit(stackdeep(stacklimit(0) / 2048));
+  } else if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: stack didn't grow\n", s);
+    exit(1);
+  }
+
   pid = fork();
   if(pid == 0) {
-    char *sp = (char *) r_sp();
-    sp -= PGSIZE;
-    // the *sp should cause a trap.
-    printf("%s: stacktest: read below stack %p\n", s, *sp);
+    // the recursion should cause a trap.
+    stackdeep(-1);
+    printf("%s: stacktest: recursion didn't fault\n", s);
     exit(1);
   } else if(pid < 0){
     printf("%s: fork failed\n", s);
@@ -2571,6 +2597,364 @@ badarg(char *s)
   exit(0);
 }
 
+// the usyscall page should agree with the system calls,
+// in a forked child too, and be read-only.
+void
+usyscall(char *s)
+{
+  int pid, xstatus;
+
+  if(ugetpid() != getpid()){
+    printf("%s: ugetpid %d, getpid %d\n", s, ugetpid(), getpid());
+    exit(1);
+  }
+  int t0 = uptime();
+  int t1 = uuptime();
+  int t2 = uptime();
+  if(t1 < t0 - 1 || t1 > t2 + 1){
+    printf("%s: uuptime %d, uptime %d..%d\n", s, t1, t0, t2);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(ugetpid() != getpid())
+      exit(1);
+    *(int *)USYSCALL = 0;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: write to usyscall page not killed\n", s);
+    exit(1);
+  }
+}
+
+// spawn() a program with its output redirected to a pipe,
+// then to a file, and check that bad programs and bad
+// file actions fail without creating a process.
+void
+spawntest(char *s)
+{
+  int fds[2], fd, n, xstatus;
+  char buf[16];
+  char *echoargv[] = { "echo", "spawn", 0 };
+  struct spawnact act[4];
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  memset(act, 0, sizeof(act));
+  act[0].op = SPAWN_DUP2;
+  act[0].fd = fds[1];
+  act[0].newfd = 1;
+  act[1].op = SPAWN_CLOSE;
+  act[1].fd = fds[0];
+  act[2].op = SPAWN_CLOSE;
+  act[2].fd = fds[1];
+  if(spawn("echo", echoargv, act) < 0){
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  n = read(fds[0], buf, sizeof(buf));
+  close(fds[0]);
+  wait(&xstatus);
+  if(n != 6 || memcmp(buf, "spawn\n", 6) != 0 || xstatus != 0){
+    printf("%s: wrong output from spawned echo\n", s);
+    exit(1);
+  }
+
+  memset(act, 0, sizeof(act));
+  act[0].op = SPAWN_OPEN;
+  act[0].newfd = 1;
+  act[0].mode = O_CREATE|O_WRONLY|O_TRUNC;
+  act[0].path = "spawn.out";
+  if(spawn("echo", echoargv, act) < 0){
+    printf("%s: spawn with open failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  fd = open("spawn.out", O_RDONLY);
+  if(fd < 0 || read(fd, buf, sizeof(buf)) != 6 || memcmp(buf, "spawn\n", 6) != 0){
+    printf("%s: wrong contents in spawn.out\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("spawn.out");
+
+  if(spawn("nonexistent", echoargv, 0) >= 0){
+    printf("%s: spawn of nonexistent program succeeded\n", s);
+    exit(1);
+  }
+  act[0].op = SPAWN_OPEN;
+  act[0].mode = O_RDONLY;
+  act[0].path = "nonexistent";
+  if(spawn("echo", echoargv, act) >= 0){
+    printf("%s: spawn with bad open succeeded\n", s);
+    exit(1);
+  }
+  act[0].op = SPAWN_DUP2;
+  act[0].fd = NOFILE;
+  if(spawn("echo", echoargv, act) >= 0){
+    printf("%s: spawn with bad dup2 succeeded\n", s);
+    exit(1);
+  }
+  if(wait(0) != -1){
+    printf("%s: failed spawn left a child\n", s);
+    exit(1);
+  }
+}
+
+// a vfork() child runs in its parent's memory, with its
+// own pid and file descriptors, until it calls exec() or
+// exit(), and the parent waits until then.
+volatile int vforkval;
+
+void
+vforktest(char *s)
+{
+  int pid, fd, xstatus;
+  char buf[16];
+  char *echoargv[] = { "echo", "vfork", 0 };
+
+  vforkval = 0;
+  pid = vfork();
+  if(pid < 0){
+    printf("%s: vfork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    vforkval = getpid();
+    if(ugetpid() != vforkval)
+      vforkval = -1;
+    exit(7);
+  }
+  if(vforkval != pid){
+    printf("%s: child's store not seen: %d, pid %d\n", s, vforkval, pid);
+    exit(1);
+  }
+  if(ugetpid() != getpid()){
+    printf("%s: parent's usyscall page not restored\n", s);
+    exit(1);
+  }
+  if(wait(&xstatus) != pid || xstatus != 7){
+    printf("%s: wrong exit status %d\n", s, xstatus);
+    exit(1);
+  }
+
+  pid = vfork();
+  if(pid < 0){
+    printf("%s: vfork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(1);
+    if(open("vfork.out", O_CREATE|O_WRONLY|O_TRUNC) != 1)
+      exit(1);
+    exec("nonexistent", echoargv);
+    exec("echo", echoargv);
+    exit(1);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: exec in vfork child failed\n", s);
+    exit(1);
+  }
+  fd = open("vfork.out", O_RDONLY);
+  if(fd < 0 || read(fd, buf, sizeof(buf)) != 6 || memcmp(buf, "vfork\n", 6) != 0){
+    printf("%s: wrong contents in vfork.out\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("vfork.out");
+}
+
+// a process that computes without sleeping uses up its
+// time slice and moves down from the top priority level.
+void
+leveltest(char *s)
+{
+  int pid, i, level;
+  volatile int spin = 0;
+
+  if((level = getlevel(getpid())) < 0 || level >= NLEVEL){
+    printf("%s: bad level %d\n", s, level);
+    exit(1);
+  }
+  if(getlevel(-1) != -1){
+    printf("%s: level for pid -1\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid == 0){
+    for(;;)
+      spin++;
+  } else if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 100; i++){
+    sleep(1);
+    if((level = getlevel(pid)) > 0)
+      break;
+  }
+  kill(pid);
+  wait(0);
+  if(level <= 0){
+    printf("%s: cpu-bound child stayed at level %d\n", s, level);
+    exit(1);
+  }
+}
+
+void
+weighttest(char *s)
+{
+  if(setweight(getpid(), 0) != -1 || setweight(getpid(), MAXWEIGHT+1) != -1){
+    printf("%s: setweight accepted a bad weight\n", s);
+    exit(1);
+  }
+  if(setweight(-1, 1) != -1){
+    printf("%s: setweight for pid -1\n", s);
+    exit(1);
+  }
+  if(setweight(getpid(), MAXWEIGHT) != 0 || setweight(getpid(), 1) != 0){
+    printf("%s: setweight failed\n", s);
+    exit(1);
+  }
+}
+
+// threads made by clone() share memory, open files and
+// the current directory with the process that made them,
+// which reaps them with join() rather than wait().
+#define NTHREAD 4
+volatile int clonecount;
+char *volatile clonemem;
+volatile int clonefd;
+volatile int clonepid, cloneupid;
+
+void
+cloneadd(void *arg)
+{
+  __sync_fetch_and_add(&clonecount, (int)(uint64)arg);
+  exit(0);
+}
+
+void
+clonesbrk(void *arg)
+{
+  char *p = sbrk(PGSIZE);
+
+  if(p != (char*)-1)
+    *p = 'x';
+  clonemem = p;
+  exit(0);
+}
+
+void
+cloneopen(void *arg)
+{
+  clonefd = open("clone.out", O_CREATE|O_WRONLY|O_TRUNC);
+  exit(0);
+}
+
+void
+clonegetpid(void *arg)
+{
+  clonepid = getpid();
+  cloneupid = ugetpid();
+  exit(0);
+}
+
+void
+clonetest(char *s)
+{
+  char *stacks;
+  int i, pid, xstatus;
+
+  stacks = sbrk(NTHREAD * PGSIZE);
+  if(stacks == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+
+  clonecount = 0;
+  for(i = 0; i < NTHREAD; i++){
+    if(clone(cloneadd, stacks + (i+1)*PGSIZE, (void*)(uint64)(i+1)) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NTHREAD; i++){
+    if(join() < 0){
+      printf("%s: join failed\n", s);
+      exit(1);
+    }
+  }
+  if(join() != -1){
+    printf("%s: join with no threads left\n", s);
+    exit(1);
+  }
+  if(clonecount != NTHREAD*(NTHREAD+1)/2){
+    printf("%s: threads' stores not seen: %d\n", s, clonecount);
+    exit(1);
+  }
+
+  // join() doesn't reap a forked child.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(3);
+  if(join() != -1 || wait(&xstatus) != pid || xstatus != 3){
+    printf("%s: join() took a forked child\n", s);
+    exit(1);
+  }
+
+  // memory one thread adds is there for the others.
+  clonemem = 0;
+  if(clone(clonesbrk, stacks + PGSIZE, 0) < 0 || join() < 0){
+    printf("%s: clone failed\n", s);
+    exit(1);
+  }
+  if(clonemem == 0 || clonemem == (char*)-1 || *clonemem != 'x'){
+    printf("%s: thread's sbrk not seen\n", s);
+    exit(1);
+  }
+
+  // and so is a file one opens.
+  clonefd = -1;
+  if(clone(cloneopen, stacks + PGSIZE, 0) < 0 || join() < 0){
+    printf("%s: clone failed\n", s);
+    exit(1);
+  }
+  if(clonefd < 0 || write(clonefd, "x", 1) != 1){
+    printf("%s: thread's file not seen\n", s);
+    exit(1);
+  }
+  close(clonefd);
+  unlink("clone.out");
+
+  // a thread's getpid() is the group's, as is its ugetpid().
+  clonepid = cloneupid = -1;
+  if(clone(clonegetpid, stacks + PGSIZE, 0) < 0 || join() < 0){
+    printf("%s: clone failed\n", s);
+    exit(1);
+  }
+  if(clonepid != getpid() || cloneupid != getpid()){
+    printf("%s: thread's getpid %d, ugetpid %d, expected %d\n",
+           s, clonepid, cloneupid, getpid());
+    exit(1);
+  }
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2635,6 +3019,14 @@ struct test {
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
+  {usyscall, "usyscall" },
+  {spawntest, "spawntest" },
+  {vforktest, "vforktest" },
+#ifndef SCHED_VRUNTIME
+  {leveltest, "leveltest" },
+#endif
+  {weighttest, "weighttest" },
+  {clonetest, "clonetest" },
 
   { 0, 0},
 };
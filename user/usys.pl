@@ -36,3 +36,10 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("spawn");
+entry("vfork");
+entry("stacklimit");
+entry("getlevel");
+entry("setweight");
+entry("clone");
+entry("join");
@@ -0,0 +1,112 @@
+// Check that the vruntime scheduler (make SCHED_VRUNTIME=1)
+// divides the CPU among CPU-bound processes in proportion to
+// their weights: starts NPER processes of each weight in
+// weights[], more than there are CPUs, lets them all spin for
+// the same number of ticks, and compares the work each group
+// got with the share its weight should give it.
+//
+// usage: weightbench [ticks]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NPER   4     // processes per weight
+#define SLACK  5     // percentage points a share may be off by
+
+int weights[] = { 1, 2, 3 };
+#define NW (sizeof(weights) / sizeof(weights[0]))
+
+void
+spin(int w, int ticks, int go, int out)
+{
+  uint64 n = 0;
+  int end;
+  char c;
+
+  if(setweight(getpid(), w) < 0){
+    printf("weightbench: setweight failed\n");
+    exit(1);
+  }
+  // wait until every process has been started.
+  read(go, &c, 1);
+  end = uuptime() + ticks;
+  for(;;){
+    n++;
+    if((n & 0xfff) == 0 && uuptime() >= end)
+      break;
+  }
+  write(out, &n, sizeof(n));
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int go[2], out[NW][2], i, j, pid, ticks = 50, wsum = 0, bad = 0;
+  int share, want;
+  uint64 n, total = 0, work[NW];
+
+  if(argc > 1)
+    ticks = atoi(argv[1]);
+  if(ticks < 1){
+    fprintf(2, "usage: weightbench [ticks]\n");
+    exit(1);
+  }
+
+  if(pipe(go) < 0){
+    printf("weightbench: pipe failed\n");
+    exit(1);
+  }
+  for(i = 0; i < NW; i++){
+    if(pipe(out[i]) < 0){
+      printf("weightbench: pipe failed\n");
+      exit(1);
+    }
+    wsum += weights[i] * NPER;
+    for(j = 0; j < NPER; j++){
+      if((pid = fork()) < 0){
+        printf("weightbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0){
+        close(go[1]);
+        spin(weights[i], ticks, go[0], out[i][1]);
+      }
+    }
+    close(out[i][1]);
+  }
+  close(go[0]);
+
+  // start them all.
+  close(go[1]);
+
+  for(i = 0; i < NW; i++){
+    work[i] = 0;
+    for(j = 0; j < NPER; j++){
+      if(read(out[i][0], &n, sizeof(n)) != sizeof(n)){
+        printf("weightbench: read failed\n");
+        exit(1);
+      }
+      work[i] += n;
+    }
+    close(out[i][0]);
+    total += work[i];
+  }
+  for(i = 0; i < NW * NPER; i++)
+    wait(0);
+
+  for(i = 0; i < NW; i++){
+    share = (work[i] * 100) / total;
+    want = (weights[i] * NPER * 100) / wsum;
+    printf("weight %d: %d%% of the CPU, expected %d%%\n", weights[i], share, want);
+    if(share < want - SLACK || share > want + SLACK)
+      bad = 1;
+  }
+  if(bad){
+    printf("weightbench: shares don't match the weights\n");
+    exit(1);
+  }
+  printf("weightbench: ok\n");
+  exit(0);
+}